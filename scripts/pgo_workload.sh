@@ -0,0 +1,28 @@
+#!/usr/bin/env zsh
+# runs the bundled Granite chat (offline batch) and prefill (perplexity) workload
+# with every binary given (default ./main) and prints tokens/s of both parts;
+# with two binaries also prints the speedup of the second over the first
+model=models/granite-3.1-1b-a400m-instruct/granite-3.1-1b-a400m-instruct-Q8_0.gguf
+bins=("$@")
+(( $# )) || bins=(./main)
+out=$(mktemp)
+typeset -A chat prefill
+for bin in $bins; do
+    rm -f $out
+    chat[$bin]=$($bin -m $model --chat-template granite -c 4096 -np 4 \
+        --batch-in scripts/pgo/chat.jsonl --batch-out $out 2>&1 >/dev/null |
+        sed -n 's/.* \([0-9.]*\) tokens\/s overall.*/\1/p')
+    prefill[$bin]=$($bin -m $model -c 256 -b 1024 --ppl scripts/pgo/prefill.txt 2>&1 >/dev/null |
+        sed -n 's/.*(\([0-9.]*\) tokens\/s evaluated).*/\1/p')
+    if [[ -z $chat[$bin] || -z $prefill[$bin] ]]; then
+        echo "$bin: workload failed" >&2
+        rm -f $out
+        exit 1
+    fi
+    printf "%-16s chat %8.2f tokens/s   prefill %8.2f tokens/s\n" $bin $chat[$bin] $prefill[$bin]
+done
+rm -f $out
+if (( $# == 2 )); then
+    printf "speedup of %s over %s: chat %.3fx, prefill %.3fx\n" $2 $1 \
+        $(( chat[$2] / chat[$1] )) $(( prefill[$2] / prefill[$1] ))
+fi
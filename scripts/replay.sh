@@ -0,0 +1,7 @@
+#!/usr/bin/env zsh
+# replays the recorded prompts with fixed seeds and fails when the tokens differ
+# from the baseline of this machine, or tokens/s or peak RSS got worse by more
+# than 5%; the first run on a machine records its baseline
+# (extra arguments go to ./main, e.g. --replay-tolerance 10)
+./main -m models/granite-3.1-1b-a400m-instruct/granite-3.1-1b-a400m-instruct-Q8_0.gguf \
+    --replay scripts/replay/prompts.jsonl --replay-baseline scripts/replay/$(hostname).baseline "$@"
@@ -0,0 +1,15 @@
+#!/usr/bin/env zsh
+# requantizes the experts of the Q8_0 model from routing statistics and checks the result:
+#   scripts/requant.sh TRAFFIC.txt EVAL.txt
+# TRAFFIC.txt should look like real prompts (or collect with --moe-stats while serving instead),
+# EVAL.txt is held-out text for the perplexity / KL-divergence check
+model=models/granite-3.1-1b-a400m-instruct/granite-3.1-1b-a400m-instruct-Q8_0.gguf
+out=models/granite-3.1-1b-a400m-instruct/granite-3.1-1b-a400m-instruct-moe.gguf
+traffic=${1:?traffic text}
+eval=${2:?evaluation text}
+rm -f moe.stats
+./main -m $model --ppl $traffic --moe-stats moe.stats || exit 1
+./main -m $model --requant $out --moe-stats moe.stats || exit 1
+./main -m $model --ppl $eval --kl-divergence-base ppl.ref || exit 1
+./main -m $out   --ppl $eval --kl-divergence-base ppl.ref --kl-divergence 2>&1 | grep "perplexity_run:"
+ls -l $model $out
@@ -0,0 +1,6 @@
+#!/usr/bin/env zsh
+# generates 100k tokens in attention-sink mode and prints tokens/s per 1024 tokens;
+# the numbers should stay flat once the window is full
+./main -no-cnv -c 2048 -n 100000 --ignore-eos --sink 4 --sink-evict 32 \
+    -p "Tell me a very long story about the sea." \
+    -m models/granite-3.1-1b-a400m-instruct/granite-3.1-1b-a400m-instruct-Q8_0.gguf 2>&1 >/dev/null | grep "^sink:"
@@ -0,0 +1,402 @@
+#include "batch.h"
+
+#include "chat-template.hpp"
+#include "json.hpp"
+#include "kv_pages.h"
+#include "log.h"
+#include "sampling.h"
+#include "scheduler.h"
+#include "trace.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+struct batch_slot {
+    llama_seq_id id = 0;
+    int32_t item = -1; // index of the running item, -1 - idle
+
+    std::vector<llama_token> cache;   // tokens in the KV cache of this sequence
+    std::vector<llama_token> pending; // tokens still to be decoded
+
+    common_sampler * smpl = nullptr;
+    std::string content;
+
+    int32_t n_cached  = 0; // prompt tokens taken from the KV cache
+    int32_t n_decoded = 0;
+    int32_t i_batch   = -1;
+
+    int64_t t_start = 0;
+    int64_t t_first = 0;
+    int64_t t_idle  = 0; // when the last item finished, for evicting the least recently used cache
+
+    bool active() const { return item >= 0; }
+};
+
+// collects the ids of results already in the output; a line torn by a crash is cut off
+static bool batch_load_done(const std::string & path, std::set<std::string> & done) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        return true; // nothing written yet
+    }
+    const std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    f.close();
+    const size_t end  = data.rfind('\n');
+    const size_t keep = end == std::string::npos ? 0 : end + 1;
+    if (keep < data.size()) {
+        LOG_WRN("%s: dropping %zu bytes of an incomplete last line in '%s'\n", __func__, data.size() - keep, path.c_str());
+        if (truncate(path.c_str(), (off_t) keep) != 0) {
+            LOG_ERR("%s: failed to truncate '%s'\n", __func__, path.c_str());
+            return false;
+        }
+    }
+    std::istringstream lines(data.substr(0, keep));
+    std::string line;
+    while (std::getline(lines, line)) {
+        try {
+            const json r = json::parse(line);
+            if (r.contains("id")) {
+                done.insert(r.at("id").dump());
+            }
+        } catch (const std::exception &) {
+            // not a result line, ignore
+        }
+    }
+    return true;
+}
+
+bool batch_load_items(const std::string & path, const llama_vocab * vocab, const common_chat_templates & templates,
+        const common_params & params, const std::set<std::string> & done, std::vector<batch_item> & items) {
+    std::ifstream f(path);
+    if (!f) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, path.c_str());
+        return false;
+    }
+    std::string line;
+    for (int n_line = 1; std::getline(f, line); n_line++) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        batch_item item;
+        try {
+            const json data = json::parse(line);
+            item.id = data.contains("id") ? data.at("id") : json(n_line);
+            if (done.count(item.id.dump())) {
+                continue;
+            }
+            std::string prompt;
+            if (data.contains("messages")) {
+                std::vector<common_chat_msg> msgs;
+                for (const auto & m : data.at("messages")) {
+                    msgs.push_back({m.at("role").get<std::string>(), m.at("content").get<std::string>(), {}});
+                }
+                prompt = common_chat_apply_template(*templates.template_default, msgs, true, params.use_jinja);
+            } else {
+                prompt = data.at("prompt").get<std::string>();
+            }
+            item.prompt    = common_tokenize(vocab, prompt, true, true);
+            item.n_predict = data.value("n_predict", params.n_predict);
+            item.seed      = data.value("seed", params.sampling.seed);
+            item.has_seed  = data.contains("seed");
+        } catch (const std::exception & e) {
+            LOG_ERR("%s: %s:%d: %s\n", __func__, path.c_str(), n_line, e.what());
+            return false;
+        }
+        if (item.prompt.empty()) {
+            LOG_ERR("%s: %s:%d: empty prompt\n", __func__, path.c_str(), n_line);
+            return false;
+        }
+        items.push_back(std::move(item));
+    }
+    return true;
+}
+
+int batch_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_ctx = llama_n_ctx(ctx);
+
+    common_chat_templates templates = common_chat_templates_from_model(model, params.chat_template);
+    if (!templates.template_default) {
+        LOG_ERR("%s: the model has no chat template\n", __func__);
+        return 1;
+    }
+
+    std::set<std::string> done;
+    if (!batch_load_done(opts.batch_out, done)) {
+        return 1;
+    }
+    std::vector<batch_item> items;
+    if (!batch_load_items(opts.batch_in, vocab, templates, params, done, items)) {
+        return 1;
+    }
+    for (const auto & item : items) {
+        if ((int32_t) item.prompt.size() >= n_ctx - 4) {
+            LOG_ERR("%s: prompt of item %s does not fit into n_ctx = %d\n", __func__, item.id.dump().c_str(), n_ctx);
+            return 1;
+        }
+    }
+    // neighbours in token order share the longest prefixes
+    std::stable_sort(items.begin(), items.end(), [](const batch_item & a, const batch_item & b) {
+        return a.prompt < b.prompt;
+    });
+
+    FILE * out = fopen(opts.batch_out.c_str(), "a");
+    if (!out) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, opts.batch_out.c_str());
+        return 1;
+    }
+
+    LOG_INF("%s: %zu items to run, %zu already done, n_parallel = %u, n_batch = %d\n", __func__,
+            items.size(), done.size(), llama_n_seq_max(ctx), params.n_batch);
+
+    kv_pages pages(ctx);
+    llama_batch batch = llama_batch_init(std::max(params.n_batch, (int32_t) llama_n_seq_max(ctx)), 0, 1);
+
+    std::vector<batch_slot> slots(llama_n_seq_max(ctx));
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].id = (llama_seq_id) i;
+    }
+
+    const int64_t t_start = ggml_time_us();
+    int64_t n_prompt_total  = 0;
+    int64_t n_cached_total  = 0;
+    int64_t n_decoded_total = 0;
+    size_t  n_done   = 0;
+    size_t  n_logged = 0;
+    size_t  next     = 0;
+    int     n_active = 0;
+    int     ret      = 0;
+
+    // items taken back from their slots while other sequences hold the KV, started again first
+    std::vector<int32_t> requeued;
+
+    auto finish = [&](batch_slot & slot, const char * stop_type) {
+        const batch_item & item = items[slot.item];
+        const int64_t t_end = ggml_time_us();
+        const json result = {
+            {"id",        item.id},
+            {"content",   slot.content},
+            {"stop_type", stop_type},
+            {"timings", {
+                {"prompt_n",      item.prompt.size()},
+                {"prompt_cached", slot.n_cached},
+                {"prompt_ms",     (slot.t_first - slot.t_start) / 1e3},
+                {"predicted_n",   slot.n_decoded},
+                {"predicted_ms",  (t_end - slot.t_first) / 1e3},
+            }},
+        };
+        {
+            TRACE_SCOPE("output", slot.id);
+            fprintf(out, "%s\n", result.dump(-1, ' ', false, json::error_handler_t::replace).c_str());
+            fflush(out);
+        }
+        n_prompt_total  += item.prompt.size();
+        n_cached_total  += slot.n_cached;
+        n_decoded_total += slot.n_decoded;
+        n_done++;
+        n_active--;
+        slot.item   = -1;
+        slot.t_idle = t_end;
+        slot.pending.clear();
+        slot.content.clear();
+    };
+
+    // nothing is written: the item runs again from its prompt once other sequences are done
+    auto requeue = [&](batch_slot & slot) {
+        LOG_DBG("batch_run: item %s waits for KV held by other sequences\n", items[slot.item].id.dump().c_str());
+        requeued.push_back(slot.item);
+        pages.release(slot.id);
+        slot.cache.clear();
+        n_active--;
+        slot.item = -1;
+        slot.pending.clear();
+        slot.content.clear();
+    };
+
+    // drops the caches of idle slots, least recently used first, until n_tokens fit into seq_id;
+    // items are sorted by prompt, so the recent caches are the prefixes the next items fork
+    auto evict_idle = [&](llama_seq_id seq_id, int32_t n_tokens) {
+        while (!pages.can_append(seq_id, n_tokens)) {
+            batch_slot * lru = nullptr;
+            for (auto & slot : slots) {
+                if (!slot.active() && !slot.cache.empty() && slot.id != seq_id && (!lru || slot.t_idle < lru->t_idle)) {
+                    lru = &slot;
+                }
+            }
+            if (!lru) {
+                return false;
+            }
+            pages.release(lru->id);
+            lru->cache.clear();
+        }
+        return true;
+    };
+
+    while (next < items.size() || !requeued.empty() || n_active > 0) {
+        // start items in idle slots, forking the longest cached prefix from any sequence
+        for (auto & slot : slots) {
+            if (slot.active() || (next >= items.size() && requeued.empty())) {
+                continue;
+            }
+            int32_t i_item;
+            if (!requeued.empty()) {
+                i_item = requeued.front();
+                requeued.erase(requeued.begin());
+            } else {
+                i_item = (int32_t) next++;
+            }
+            const batch_item & item = items[i_item];
+            batch_slot * donor = &slot;
+            size_t n_best = 0;
+            for (auto & other : slots) {
+                size_t n = 0;
+                while (n < other.cache.size() && n < item.prompt.size() && other.cache[n] == item.prompt[n]) {
+                    n++;
+                }
+                if (n > n_best) {
+                    donor  = &other;
+                    n_best = n;
+                }
+            }
+            if (n_best == item.prompt.size()) {
+                n_best--; // the last prompt token is decoded again for its logits
+            }
+            if (donor == &slot) {
+                pages.truncate(slot.id, (int32_t) n_best);
+            } else {
+                pages.fork(donor->id, slot.id, (int32_t) n_best);
+            }
+            slot.cache.assign(item.prompt.begin(), item.prompt.begin() + n_best);
+            slot.pending.assign(item.prompt.begin() + n_best, item.prompt.end());
+
+            common_params_sampling sparams = params.sampling;
+            sparams.seed = item.seed;
+            common_sampler_free(slot.smpl);
+            slot.smpl = common_sampler_init(model, sparams);
+            for (llama_token id : item.prompt) {
+                common_sampler_accept(slot.smpl, id, false);
+            }
+
+            slot.item      = i_item;
+            slot.n_cached  = (int32_t) n_best;
+            slot.n_decoded = 0;
+            slot.t_start   = ggml_time_us();
+            slot.t_first   = slot.t_start;
+            n_active++;
+        }
+
+        // throughput first: prefill may fill the whole batch next to decoding sequences
+        const int64_t t_batch = g_trace_enabled ? ggml_time_us() : 0;
+        std::vector<sched_job>    jobs;
+        std::vector<batch_slot *> job_slots;
+        for (auto & slot : slots) {
+            slot.i_batch = -1;
+            if (slot.active() && !slot.pending.empty()) {
+                jobs.push_back({{slot.item}, (int32_t) slot.pending.size(), slot.n_decoded > 0});
+                job_slots.push_back(&slot);
+            }
+        }
+        const std::vector<int32_t> plan = sched_plan(jobs, params.n_batch, params.n_batch);
+
+        common_batch_clear(batch);
+        for (size_t j = 0; j < job_slots.size(); j++) {
+            batch_slot & slot = *job_slots[j];
+            const int32_t n = plan[j];
+            if (n == 0) {
+                continue;
+            }
+            if (!evict_idle(slot.id, n) || !pages.append(slot.id, n)) {
+                // "limit" only when the sequence could not fit even with the whole cache to itself
+                if (slot.cache.size() + n > (size_t) n_ctx || n_active == 1) {
+                    finish(slot, "limit");
+                } else {
+                    requeue(slot);
+                }
+                continue;
+            }
+            for (int32_t i = 0; i < n; i++) {
+                const bool last = i == n - 1 && n == (int32_t) slot.pending.size();
+                common_batch_add(batch, slot.pending[i], (llama_pos) slot.cache.size() + i, { slot.id }, last);
+            }
+            slot.cache.insert(slot.cache.end(), slot.pending.begin(), slot.pending.begin() + n);
+            slot.pending.erase(slot.pending.begin(), slot.pending.begin() + n);
+            if (slot.pending.empty()) {
+                slot.i_batch = batch.n_tokens - 1;
+            }
+        }
+        if (batch.n_tokens == 0) {
+            continue;
+        }
+        if (g_trace_enabled) {
+            trace_add("batch", t_batch, ggml_time_us(), batch.n_tokens);
+        }
+        int32_t res;
+        {
+            TRACE_SCOPE("decode", batch.n_tokens);
+            trace_decode_begin();
+            res = llama_decode(ctx, batch);
+        }
+        if (res != 0) {
+            LOG_ERR("%s: llama_decode() failed for %d tokens\n", __func__, batch.n_tokens);
+            ret = 1;
+            break;
+        }
+
+        for (auto & slot : slots) {
+            if (slot.i_batch < 0 || !slot.active()) {
+                continue;
+            }
+            llama_token id;
+            {
+                TRACE_SCOPE("sample", slot.id);
+                id = common_sampler_sample(slot.smpl, ctx, slot.i_batch);
+                common_sampler_accept(slot.smpl, id, true);
+            }
+            if (slot.n_decoded++ == 0) {
+                slot.t_first = ggml_time_us();
+            }
+            if (llama_vocab_is_eog(vocab, id)) {
+                finish(slot, "eos");
+                continue;
+            }
+            {
+                TRACE_SCOPE("detokenize", slot.id);
+                slot.content += common_token_to_piece(ctx, id, params.special);
+            }
+            const batch_item & item = items[slot.item];
+            if (item.n_predict >= 0 && slot.n_decoded >= item.n_predict) {
+                finish(slot, "length");
+                continue;
+            }
+            slot.pending.push_back(id);
+        }
+
+        if (params.n_print > 0 && n_done >= n_logged + params.n_print) {
+            LOG_INF("%s: %zu / %zu done\n", __func__, n_done, items.size());
+            n_logged = n_done;
+        }
+    }
+
+    const double t_s = (ggml_time_us() - t_start) / 1e6;
+    LOG_INF("\n%s: %zu items in %.2f s (%.1f items/hour)\n", __func__, n_done, t_s, t_s > 0 ? 3600.0 * n_done / t_s : 0.0);
+    LOG_INF("%s: prompt %lld tokens (%lld reused from KV), generated %lld tokens, %.2f tokens/s overall\n", __func__,
+            (long long) n_prompt_total, (long long) n_cached_total, (long long) n_decoded_total,
+            t_s > 0 ? (n_prompt_total - n_cached_total + n_decoded_total) / t_s : 0.0);
+    LOG_INF("%s\n", pages.print().c_str());
+
+    for (auto & slot : slots) {
+        common_sampler_free(slot.smpl);
+    }
+    llama_batch_free(batch);
+    fclose(out);
+    return ret;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "common.h"
+#include "chat-template.hpp"
+#include "json.hpp"
+#include "options.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+// Offline batch generation (--batch-in FILE --batch-out FILE).
+//
+// Every input line is a JSON request:
+//
+//   {"id": "q1", "messages": [{"role": "user", "content": "..."}], "n_predict": 256}
+//   {"id": "q2", "prompt": "...", "seed": 7}
+//
+// Requests are sorted by prompt so that neighbours share prefixes, then
+// decoded n_parallel (-np, 8 unless given) at a time in one llama_batch. A
+// new request forks the longest matching prefix from any sequence already
+// in the KV cache instead of prefilling it again. A request that finds no
+// room while other sequences hold the cache goes back into the queue and
+// starts over once they are done. Every result is appended to the
+// output as one JSON line with per-item timings; on restart the ids
+// already present in the output are skipped, so a crashed run resumes
+// where it stopped.
+
+struct batch_item {
+    nlohmann::ordered_json   id;
+    std::vector<llama_token> prompt;
+    int32_t                  n_predict = -1;
+    uint32_t                 seed      = LLAMA_DEFAULT_SEED;
+    bool                     has_seed  = false; // "seed" was in the request, not taken from --seed
+};
+
+// tokenized requests of the JSONL file at path, except those whose id (as JSON) is in done
+bool batch_load_items(const std::string & path, const llama_vocab * vocab, const common_chat_templates & templates,
+        const common_params & params, const std::set<std::string> & done, std::vector<batch_item> & items);
+
+int batch_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx);
@@ -0,0 +1,111 @@
+#include "embed.h"
+
+#include "log.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// decodes the packed documents and appends one pooled, normalised row per document
+static bool embed_flush(llama_context * ctx, llama_batch & batch, int32_t n_seqs, int32_t n_embd, int32_t embd_norm,
+        std::vector<float> & rows, FILE * out) {
+    if (n_seqs == 0) {
+        return true;
+    }
+    llama_kv_cache_clear(ctx);
+    if (batch.n_tokens > 0 && llama_decode(ctx, batch) != 0) {
+        LOG_ERR("%s: llama_decode() failed for %d tokens\n", __func__, batch.n_tokens);
+        return false;
+    }
+    rows.assign((size_t) n_seqs * n_embd, 0.0f);
+    for (int32_t s = 0; s < n_seqs; s++) {
+        const float * embd = llama_get_embeddings_seq(ctx, s);
+        if (embd) { // empty documents have no tokens and stay zero
+            common_embd_normalize(embd, rows.data() + (size_t) s * n_embd, n_embd, embd_norm);
+        }
+    }
+    common_batch_clear(batch);
+    return fwrite(rows.data(), sizeof(float), rows.size(), out) == rows.size();
+}
+
+int embed_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_embd  = llama_model_n_embd(model);
+    const int32_t n_batch = (int32_t) llama_n_batch(ctx);
+    const int32_t n_seq   = (int32_t) llama_n_seq_max(ctx);
+
+    if (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE) {
+        LOG_ERR("%s: pooling type 'none' does not produce sentence embeddings, use --pooling\n", __func__);
+        return 1;
+    }
+
+    std::ifstream in(opts.embed);
+    if (!in) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, opts.embed.c_str());
+        return 1;
+    }
+    FILE * out = fopen(opts.embed_out.c_str(), "wb");
+    if (!out) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, opts.embed_out.c_str());
+        return 1;
+    }
+    const bool matrix = opts.embed_format == "matrix";
+    embed_header header;
+    header.n_embd = (uint32_t) n_embd;
+    if (matrix) {
+        fwrite(&header, sizeof(header), 1, out); // n_rows is filled in at the end
+    }
+
+    LOG_INF("%s: n_embd = %d, n_batch = %d, n_seq_max = %d, pooling = %d, normalize = %d\n", __func__,
+            n_embd, n_batch, n_seq, (int) llama_pooling_type(ctx), params.embd_normalize);
+
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    std::vector<float> rows;
+
+    const int64_t t_start = ggml_time_us();
+    int64_t n_tokens_total = 0;
+    int32_t n_truncated    = 0;
+    int32_t n_seqs         = 0;
+    bool    ok             = true;
+
+    std::string line;
+    while (ok && std::getline(in, line)) {
+        std::vector<llama_token> tokens = common_tokenize(vocab, line, true, false);
+        if ((int32_t) tokens.size() > n_batch) {
+            tokens.resize(n_batch); // a document has to fit into one batch
+            n_truncated++;
+        }
+        if (n_seqs == n_seq || batch.n_tokens + (int32_t) tokens.size() > n_batch) {
+            ok = embed_flush(ctx, batch, n_seqs, n_embd, params.embd_normalize, rows, out);
+            n_seqs = 0;
+        }
+        for (size_t i = 0; i < tokens.size(); i++) {
+            common_batch_add(batch, tokens[i], (llama_pos) i, { n_seqs }, true);
+        }
+        n_tokens_total += tokens.size();
+        n_seqs++;
+        header.n_rows++;
+    }
+    ok = ok && embed_flush(ctx, batch, n_seqs, n_embd, params.embd_normalize, rows, out);
+
+    if (matrix) {
+        fseek(out, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, out);
+    }
+    ok = fclose(out) == 0 && ok;
+    llama_batch_free(batch);
+
+    if (!ok) {
+        LOG_ERR("%s: failed to write '%s'\n", __func__, opts.embed_out.c_str());
+        return 1;
+    }
+    if (n_truncated > 0) {
+        LOG_WRN("%s: %d documents were longer than n_batch = %d tokens and were truncated\n", __func__, n_truncated, n_batch);
+    }
+    const double t_s = (ggml_time_us() - t_start) / 1e6;
+    LOG_INF("%s: %u documents, %lld tokens in %.2f s (%.1f tokens/s) -> '%s' (%s, %u x %u)\n", __func__,
+            header.n_rows, (long long) n_tokens_total, t_s, t_s > 0 ? n_tokens_total / t_s : 0.0,
+            opts.embed_out.c_str(), matrix ? "matrix" : "raw", header.n_rows, header.n_embd);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+
+#include <cstdint>
+
+// Pooled sentence embeddings (--embed FILE --embed-out FILE).
+//
+// Every line of the input is one document. Documents are packed into a
+// single llama_decode() as separate sequences until n_batch tokens or the
+// context's n_seq_max is reached, pooled (--pooling, mean by default),
+// L2-normalised (--embd-normalize) and appended to the output in input
+// order. The output is either raw float32 rows or, by default, the same
+// rows behind an embed_header so the file can be mmap-ed as a matrix.
+
+struct embed_header {
+    char     magic[4] = { 'E', 'M', 'B', 'D' };
+    uint32_t version  = 1;
+    uint32_t n_rows   = 0; // documents
+    uint32_t n_embd   = 0; // floats per row, rows start at sizeof(embed_header)
+};
+
+static_assert(sizeof(embed_header) == 16, "rows must stay 16-byte aligned");
+
+int embed_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx);
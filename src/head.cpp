@@ -0,0 +1,157 @@
+#include "head.h"
+
+#include "gguf.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstring>
+
+static ggml_backend_sched_eval_callback g_head_next = nullptr;
+
+static bool               g_head_armed  = false;
+static std::vector<float> g_head_hidden;
+static int64_t            g_head_n_embd = 0;
+static int64_t            g_head_n_rows = 0;
+
+head_rows::head_rows(const std::string & path) {
+    ggml_context * meta = nullptr;
+    gguf_init_params ip = { /*.no_alloc =*/ true, /*.ctx =*/ &meta };
+    gguf_context * g = gguf_init_from_file(path.c_str(), ip);
+    if (!g) {
+        LOG_ERR("%s: failed to read '%s'\n", __func__, path.c_str());
+        return;
+    }
+    const char * name = gguf_find_tensor(g, "output.weight") >= 0 ? "output.weight" : "token_embd.weight";
+    const int64_t i_out = gguf_find_tensor(g, name);
+    const ggml_tensor * w = i_out >= 0 ? ggml_get_tensor(meta, name) : nullptr;
+    const ggml_type_traits * traits = w ? ggml_get_type_traits(w->type) : nullptr;
+    if (!w || (w->type != GGML_TYPE_F32 && !traits->to_float)) {
+        LOG_ERR("%s: no usable output matrix in '%s'\n", __func__, path.c_str());
+        gguf_free(g);
+        ggml_free(meta);
+        return;
+    }
+    type   = w->type;
+    n_cols = w->ne[0];
+    n_rows = w->ne[1];
+    offset = gguf_get_data_offset(g) + gguf_get_tensor_offset(g, i_out);
+
+    // what llama.cpp applies to the output of the matmul for these architectures
+    const int64_t i_arch = gguf_find_key(g, "general.architecture");
+    const std::string arch = i_arch >= 0 ? gguf_get_val_str(g, i_arch) : "";
+    const int64_t i_scale = gguf_find_key(g, (arch + ".logit_scale").c_str());
+    if (i_scale >= 0) {
+        const float s = gguf_get_val_f32(g, i_scale);
+        scale = arch == "granite" || arch == "granitemoe" ? 1.0f / s : s;
+    }
+    const int64_t i_softcap = gguf_find_key(g, (arch + ".final_logit_softcapping").c_str());
+    if (i_softcap >= 0) {
+        softcap = gguf_get_val_f32(g, i_softcap);
+    }
+
+    fd = open(path.c_str(), O_RDONLY);
+    const int64_t i_bias = gguf_find_tensor(g, "output.bias");
+    if (fd >= 0 && i_bias >= 0 && gguf_get_tensor_type(g, i_bias) == GGML_TYPE_F32) {
+        bias.resize(n_rows);
+        const size_t n = n_rows * sizeof(float);
+        if (pread(fd, bias.data(), n, gguf_get_data_offset(g) + gguf_get_tensor_offset(g, i_bias)) != (ssize_t) n) {
+            bias.clear();
+        }
+    }
+    LOG_INF("%s: %s %s [%lld x %lld], scale %g, softcap %g\n", __func__, name, ggml_type_name(type),
+            (long long) n_cols, (long long) n_rows, scale, softcap);
+    gguf_free(g);
+    ggml_free(meta);
+}
+
+head_rows::~head_rows() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+const std::vector<float> & head_rows::row(llama_token id) {
+    auto it = rows.find(id);
+    if (it != rows.end()) {
+        return it->second;
+    }
+    std::vector<float> & r = rows[id];
+    r.assign(n_cols, 0.0f);
+    const size_t n = ggml_row_size(type, n_cols);
+    buf.resize(n);
+    if (id < 0 || id >= n_rows || pread(fd, buf.data(), n, offset + (size_t) id * n) != (ssize_t) n) {
+        LOG_ERR("%s: failed to read the row of token %d\n", __func__, id);
+        return r;
+    }
+    if (type == GGML_TYPE_F32) {
+        memcpy(r.data(), buf.data(), n);
+    } else {
+        ggml_get_type_traits(type)->to_float(buf.data(), r.data(), n_cols);
+    }
+    return r;
+}
+
+void head_rows::logits(const float * h, const std::vector<llama_token> & tokens, std::vector<float> & out) {
+    out.resize(tokens.size());
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const std::vector<float> & r = row(tokens[i]);
+        double sum = 0.0;
+        for (int64_t j = 0; j < n_cols; j++) {
+            sum += (double) h[j] * r[j];
+        }
+        float v = (float) sum * scale;
+        if (!bias.empty() && tokens[i] >= 0 && tokens[i] < n_rows) {
+            v += bias[tokens[i]];
+        }
+        if (softcap > 0.0f) {
+            v = softcap * tanhf(v / softcap);
+        }
+        out[i] = v;
+    }
+}
+
+void head_init(ggml_backend_sched_eval_callback next) {
+    g_head_next = next;
+}
+
+void head_skip_next(bool skip) {
+    g_head_armed = skip;
+    if (skip) {
+        g_head_hidden.clear();
+        g_head_n_rows = 0;
+    }
+}
+
+const float * head_hidden(int32_t i) {
+    if (i < 0 || i >= g_head_n_rows) {
+        return nullptr;
+    }
+    return g_head_hidden.data() + (size_t) i * g_head_n_embd;
+}
+
+bool head_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    if (!g_head_armed || strcmp(t->name, "result_norm") != 0 || t->type != GGML_TYPE_F32 || !ggml_is_contiguous(t)) {
+        return g_head_next ? g_head_next(t, ask, user_data) : !ask;
+    }
+    if (ask) {
+        return true;
+    }
+    // one call per micro-batch, their output rows follow each other in batch order
+    const size_t n0 = g_head_hidden.size();
+    g_head_n_embd  = t->ne[0];
+    g_head_n_rows += ggml_nrows(t);
+    g_head_hidden.resize(n0 + ggml_nelements(t));
+    if (!t->buffer || ggml_backend_buffer_is_host(t->buffer)) {
+        memcpy(g_head_hidden.data() + n0, t->data, ggml_nbytes(t));
+    } else {
+        ggml_backend_tensor_get(t, g_head_hidden.data() + n0, 0, ggml_nbytes(t));
+    }
+    if (g_head_next && g_head_next(t, true, user_data)) {
+        g_head_next(t, false, user_data);
+    }
+    // the rest of the graph is the output matmul
+    return false;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Output head restricted to a candidate set of tokens.
+//
+// When a sequence may only continue with a few tokens (classification
+// labels, a fixed set of choices) the projection onto the whole vocabulary
+// is wasted work. head_eval_callback() watches the graph for the final
+// norm ("result_norm"); while armed with head_skip_next() it keeps those
+// rows and tells the scheduler to stop there, so every micro-batch of the
+// next llama_decode() skips the rest of its split, which with everything on
+// one backend is just the output matmul; the context's logits are then left
+// stale. The callback is only installed with --choice-head 1.
+// head_rows then computes exact logits for just the candidates from their
+// rows of the output matrix (output.weight, or token_embd.weight for tied
+// embeddings), read from the GGUF and dequantized on first use, including
+// the architecture's logit scaling and soft-capping.
+
+struct head_rows {
+    explicit head_rows(const std::string & path);
+    ~head_rows();
+
+    bool    ok()     const { return fd >= 0; }
+    int64_t n_embd() const { return n_cols; }
+
+    // logits of tokens for one hidden state h of n_embd floats
+    void logits(const float * h, const std::vector<llama_token> & tokens, std::vector<float> & out);
+
+private:
+    const std::vector<float> & row(llama_token id);
+
+    int       fd     = -1;
+    size_t    offset = 0; // of the output matrix in the file
+    ggml_type type   = GGML_TYPE_F32;
+    int64_t   n_cols = 0;
+    int64_t   n_rows = 0;
+
+    float scale   = 1.0f; // applied to the dot products
+    float softcap = 0.0f; // 0 - none
+
+    std::vector<float> bias;
+    std::vector<uint8_t> buf;
+
+    std::unordered_map<llama_token, std::vector<float>> rows;
+};
+
+// eval callback for common_params::cb_eval, chains to next (if any) for other tensors
+bool head_eval_callback(struct ggml_tensor * t, bool ask, void * user_data);
+void head_init(ggml_backend_sched_eval_callback next);
+
+// true: the next llama_decode() stops after the final norm of every micro-batch and keeps
+// its rows (the previous ones are dropped); false, once that decode returned: disarm
+void head_skip_next(bool skip);
+
+// hidden state of output i (in batch order) of the last decode armed with head_skip_next(true),
+// nullptr if it did not produce one
+const float * head_hidden(int32_t i);
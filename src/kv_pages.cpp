@@ -0,0 +1,146 @@
+#include "kv_pages.h"
+
+#include <cstdio>
+
+kv_pages::kv_pages(llama_context * ctx, int32_t n_block_size) : ctx(ctx), block_size(n_block_size) {
+    GGML_ASSERT(block_size > 0);
+    const int32_t n_blocks = (int32_t) llama_n_ctx(ctx) / block_size;
+    refs.assign(n_blocks, 0);
+    free_list.reserve(n_blocks);
+    for (int32_t i = n_blocks - 1; i >= 0; i--) {
+        free_list.push_back(i); // lowest index is handed out first
+    }
+    seqs.resize(llama_n_seq_max(ctx));
+}
+
+kv_pages::seq_table & kv_pages::table(llama_seq_id seq_id) {
+    GGML_ASSERT(seq_id >= 0 && seq_id < (llama_seq_id) seqs.size());
+    return seqs[seq_id];
+}
+
+int32_t kv_pages::alloc() {
+    GGML_ASSERT(!free_list.empty());
+    const int32_t block = free_list.back();
+    free_list.pop_back();
+    refs[block] = 1;
+    return block;
+}
+
+void kv_pages::unref(int32_t block) {
+    GGML_ASSERT(refs[block] > 0);
+    if (--refs[block] == 0) {
+        free_list.push_back(block);
+    }
+}
+
+int32_t kv_pages::blocks_needed(llama_seq_id seq_id, int32_t n_tokens) const {
+    GGML_ASSERT(seq_id >= 0 && seq_id < (llama_seq_id) seqs.size());
+    if (n_tokens <= 0) {
+        return 0;
+    }
+    const seq_table & t = seqs[seq_id];
+    const int32_t tail = (int32_t) t.blocks.size() * block_size - t.n_tokens; // free cells in the last block
+    int32_t n = 0;
+    if (tail > 0 && refs[t.blocks.back()] > 1) {
+        n++; // copy-on-write of the shared, partially filled last block
+    }
+    if (n_tokens > tail) {
+        n += (n_tokens - tail + block_size - 1) / block_size;
+    }
+    return n;
+}
+
+bool kv_pages::can_append(llama_seq_id seq_id, int32_t n_tokens) const {
+    return blocks_needed(seq_id, n_tokens) <= n_free();
+}
+
+bool kv_pages::append(llama_seq_id seq_id, int32_t n_tokens) {
+    if (!can_append(seq_id, n_tokens)) {
+        return false;
+    }
+    seq_table & t = table(seq_id);
+    if (t.n_tokens % block_size != 0 && refs[t.blocks.back()] > 1) {
+        // the shared prefix cells stay in place (llama tags them with both
+        // sequences), the private copy only takes the new tokens
+        const int32_t copy = alloc();
+        unref(t.blocks.back());
+        t.blocks.back() = copy;
+    }
+    t.n_tokens += n_tokens;
+    while ((int32_t) t.blocks.size() * block_size < t.n_tokens) {
+        t.blocks.push_back(alloc());
+    }
+    return true;
+}
+
+void kv_pages::fork(llama_seq_id src, llama_seq_id dst, int32_t n_tokens) {
+    GGML_ASSERT(src != dst);
+    release(dst);
+    const seq_table & s = table(src);
+    seq_table & d = table(dst);
+    if (n_tokens < 0 || n_tokens > s.n_tokens) {
+        n_tokens = s.n_tokens;
+    }
+    const int32_t n_blocks = (n_tokens + block_size - 1) / block_size;
+    for (int32_t i = 0; i < n_blocks; i++) {
+        refs[s.blocks[i]]++;
+        d.blocks.push_back(s.blocks[i]);
+    }
+    d.n_tokens = n_tokens;
+    // sequence positions are [0, n_tokens) - no context shifting on managed sequences
+    llama_kv_cache_seq_cp(ctx, src, dst, 0, n_tokens);
+}
+
+void kv_pages::truncate(llama_seq_id seq_id, int32_t n_tokens) {
+    seq_table & t = table(seq_id);
+    if (n_tokens < 0 || n_tokens >= t.n_tokens) {
+        return;
+    }
+    llama_kv_cache_seq_rm(ctx, seq_id, n_tokens, -1);
+    const int32_t n_blocks = (n_tokens + block_size - 1) / block_size;
+    while ((int32_t) t.blocks.size() > n_blocks) {
+        unref(t.blocks.back());
+        t.blocks.pop_back();
+    }
+    t.n_tokens = n_tokens;
+}
+
+void kv_pages::release(llama_seq_id seq_id) {
+    seq_table & t = table(seq_id);
+    llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+    for (int32_t block : t.blocks) {
+        unref(block);
+    }
+    t.blocks.clear();
+    t.n_tokens = 0;
+}
+
+int32_t kv_pages::seq_len(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && seq_id < (llama_seq_id) seqs.size());
+    return seqs[seq_id].n_tokens;
+}
+
+kv_pages_stats kv_pages::stats() const {
+    kv_pages_stats s;
+    s.n_block_size = block_size;
+    s.n_blocks     = (int32_t) refs.size();
+    s.n_free       = n_free();
+    for (int32_t r : refs) {
+        s.n_shared += r > 1;
+    }
+    for (const seq_table & t : seqs) {
+        s.n_seqs   += !t.blocks.empty();
+        s.n_tokens += t.n_tokens;
+    }
+    s.n_cells_used = llama_get_kv_cache_used_cells(ctx);
+    return s;
+}
+
+std::string kv_pages::print() const {
+    const kv_pages_stats s = stats();
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+            "kv pages: block = %d, blocks = %d, free = %d, shared = %d, seqs = %d, tokens = %d, cells used = %d",
+            s.n_block_size, s.n_blocks, s.n_free, s.n_shared, s.n_seqs, s.n_tokens, s.n_cells_used);
+    return buf;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "llama.h"
+
+#include <string>
+#include <vector>
+
+// Paged view over the unified llama KV cache.
+//
+// The n_ctx cells of a context are split into fixed-size blocks that form a
+// shared pool. Every sequence owns a block table; the tokens of a sequence
+// occupy its blocks in order. Forking a sequence shares the prefix blocks
+// (the cells are shared in llama via llama_kv_cache_seq_cp) and the first
+// append into a shared, partially filled block copies it on write.
+//
+// The accounting is conservative: a copied block still counts the shared
+// prefix cells. The free blocks are still only an upper bound on what
+// llama_decode will be able to place: the unified cache needs contiguous
+// free cells for every micro-batch, and block counts ignore fragmentation,
+// so llama_decode can return 1 even though the append was admitted; the
+// caller then rolls the append back with truncate(), frees cells or
+// decodes fewer tokens, and tries again. Callers should go through kv_pages
+// for every KV mutation of the sequences it manages.
+
+struct kv_pages_stats {
+    int32_t n_block_size = 0; // cells per block
+    int32_t n_blocks     = 0; // blocks in the pool
+    int32_t n_free       = 0; // blocks not referenced by any sequence
+    int32_t n_shared     = 0; // blocks referenced by more than one sequence
+    int32_t n_seqs       = 0; // sequences with a non-empty block table
+    int32_t n_tokens     = 0; // sum of logical sequence lengths
+    int32_t n_cells_used = 0; // llama_get_kv_cache_used_cells()
+};
+
+struct kv_pages {
+    kv_pages(llama_context * ctx, int32_t n_block_size = 16);
+
+    // blocks needed to append n_tokens to seq_id (including a copy-on-write)
+    int32_t blocks_needed(llama_seq_id seq_id, int32_t n_tokens) const;
+
+    // admission control: can n_tokens more tokens be appended to seq_id?
+    bool can_append(llama_seq_id seq_id, int32_t n_tokens) const;
+
+    // claim blocks for n_tokens that the caller is about to llama_decode()
+    // at the end of seq_id; false (and nothing claimed) if the pool is short
+    bool append(llama_seq_id seq_id, int32_t n_tokens);
+
+    // share the first n_tokens (-1 - all) of src with dst (dst is released first)
+    void fork(llama_seq_id src, llama_seq_id dst, int32_t n_tokens = -1);
+
+    // keep only the first n_tokens of seq_id (rollback)
+    void truncate(llama_seq_id seq_id, int32_t n_tokens);
+
+    // drop all cells and blocks of seq_id
+    void release(llama_seq_id seq_id);
+
+    int32_t seq_len(llama_seq_id seq_id) const;
+    int32_t n_free() const { return (int32_t) free_list.size(); }
+
+    kv_pages_stats stats() const;
+    std::string    print() const;
+
+private:
+    struct seq_table {
+        std::vector<int32_t> blocks; // indices into refs
+        int32_t n_tokens = 0;
+    };
+
+    seq_table & table(llama_seq_id seq_id);
+    int32_t     alloc();
+    void        unref(int32_t block);
+
+    llama_context * ctx;
+    int32_t block_size;
+
+    std::vector<int32_t>   refs;      // reference count per block
+    std::vector<int32_t>   free_list; // LIFO of unreferenced blocks
+    std::vector<seq_table> seqs;      // indexed by llama_seq_id
+};
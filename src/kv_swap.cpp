@@ -0,0 +1,204 @@
+#include "kv_swap.h"
+
+#include "log.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// shared by every kv_swap of the process, so contexts of different models can use one directory
+static std::atomic<uint32_t> g_kv_swap_files{0};
+
+kv_swap::kv_swap(llama_context * ctx, const std::string & dir, size_t n_max_bytes) :
+        ctx(ctx), dir(dir), n_max_bytes(n_max_bytes) {
+    while (!this->dir.empty() && this->dir.size() > 1 && this->dir.back() == '/') {
+        this->dir.pop_back();
+    }
+}
+
+kv_swap::~kv_swap() {
+    while (!entries.empty()) {
+        remove((int32_t) entries.size() - 1);
+    }
+}
+
+bool kv_swap::swap_out(llama_seq_id seq_id, const std::vector<llama_token> & tokens, int32_t tag) {
+    if (!enabled() || tokens.empty()) {
+        return false;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/kv-%d-%u.bin", (int) getpid(), g_kv_swap_files++);
+    kv_swap_entry e;
+    e.path    = dir + name;
+    e.tokens  = tokens;
+    e.tag     = tag;
+    e.n_bytes = llama_state_seq_save_file(ctx, e.path.c_str(), seq_id, tokens.data(), tokens.size());
+    if (e.n_bytes == 0) {
+        LOG_ERR("%s: failed to write '%s'\n", __func__, e.path.c_str());
+        std::remove(e.path.c_str());
+        return false;
+    }
+    const std::string path = e.path;
+    entries.push_back(std::move(e));
+    for (size_t n = n_bytes(); n_max_bytes > 0 && n > n_max_bytes && !entries.empty(); ) {
+        LOG_INF("%s: removing '%s', %.1f MiB over --kv-swap-max\n", __func__, entries[0].path.c_str(),
+                (n - n_max_bytes) / 1048576.0);
+        n -= entries[0].n_bytes;
+        remove(0);
+    }
+    return !entries.empty() && entries.back().path == path;
+}
+
+int32_t kv_swap::find(const std::vector<llama_token> & prompt, size_t & n_prefix, int32_t tag) const {
+    int32_t best = -1;
+    n_prefix = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].tag != tag) {
+            continue;
+        }
+        const auto & tokens = entries[i].tokens;
+        size_t n = 0;
+        while (n < tokens.size() && n < prompt.size() && tokens[n] == prompt[n]) {
+            n++;
+        }
+        if (n > n_prefix) {
+            best     = (int32_t) i;
+            n_prefix = n;
+        }
+    }
+    return best;
+}
+
+bool kv_swap::swap_in(int32_t i, llama_seq_id seq_id, std::vector<llama_token> & tokens) {
+    tokens.resize(entries[i].tokens.size());
+    size_t n_tokens = 0;
+    const size_t n = llama_state_seq_load_file(ctx, entries[i].path.c_str(), seq_id, tokens.data(), tokens.size(), &n_tokens);
+    remove(i);
+    if (n == 0) {
+        LOG_ERR("%s: failed to restore sequence %d\n", __func__, seq_id);
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        tokens.clear();
+        return false;
+    }
+    tokens.resize(n_tokens);
+    return true;
+}
+
+int32_t kv_swap::index_of(const std::string & path) const {
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].path == path) {
+            return (int32_t) i;
+        }
+    }
+    return -1;
+}
+
+size_t kv_swap::n_bytes() const {
+    size_t n = 0;
+    for (const auto & e : entries) {
+        n += e.n_bytes;
+    }
+    return n;
+}
+
+void kv_swap::remove(int32_t i) {
+    std::remove(entries[i].path.c_str());
+    entries.erase(entries.begin() + i);
+}
+
+// decodes tokens [i0, end) of seq 0 starting at position i0, logits of the last token only
+static bool kv_swap_prefill(llama_context * ctx, llama_batch & batch, const std::vector<llama_token> & tokens,
+        size_t i0, int32_t n_batch) {
+    for (size_t i = i0; i < tokens.size(); ) {
+        common_batch_clear(batch);
+        for (; i < tokens.size() && batch.n_tokens < n_batch; i++) {
+            common_batch_add(batch, tokens[i], (llama_pos) i, { 0 }, i == tokens.size() - 1);
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int kv_swap_bench(common_params & params, const options & opts, llama_model * model, llama_context * ctx) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    const int32_t n_batch = (int32_t) llama_n_batch(ctx);
+    const int32_t n_tokens = std::min(opts.n_kv_swap_bench, (int32_t) llama_n_ctx(ctx) - 1);
+    const int     n_reps   = 3;
+
+    std::string text = params.prompt.empty() ? "The quick brown fox jumps over the lazy dog. " : params.prompt;
+    std::vector<llama_token> tokens = common_tokenize(vocab, text, true, true);
+    while (!tokens.empty() && (int32_t) tokens.size() < n_tokens) {
+        text += text;
+        tokens = common_tokenize(vocab, text, true, true);
+    }
+    tokens.resize(std::min<size_t>(tokens.size(), n_tokens));
+    if (tokens.size() < 2) {
+        LOG_ERR("%s: need at least 2 tokens\n", __func__);
+        return 1;
+    }
+
+    kv_swap swap(ctx, opts.kv_swap.empty() ? "." : opts.kv_swap);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    std::vector<float> logits(n_vocab);
+    std::vector<llama_token> restored;
+    double t_prefill = 1e30, t_out = 1e30, t_in = 1e30, diff = 0.0;
+    size_t n_bytes = 0;
+    bool ok = true;
+
+    for (int rep = 0; ok && rep < n_reps; rep++) {
+        llama_kv_cache_clear(ctx);
+        int64_t t0 = ggml_time_us();
+        ok = kv_swap_prefill(ctx, batch, tokens, 0, n_batch);
+        t_prefill = std::min(t_prefill, (ggml_time_us() - t0) / 1e3);
+        if (!ok) {
+            break;
+        }
+        std::copy_n(llama_get_logits_ith(ctx, -1), n_vocab, logits.begin());
+
+        t0 = ggml_time_us();
+        ok = swap.swap_out(0, tokens);
+        t_out = std::min(t_out, (ggml_time_us() - t0) / 1e3);
+        if (!ok) {
+            break;
+        }
+        n_bytes = swap.n_bytes();
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+
+        t0 = ggml_time_us();
+        ok = swap.swap_in(0, 0, restored) && restored == tokens;
+        t_in = std::min(t_in, (ggml_time_us() - t0) / 1e3);
+        if (!ok) {
+            LOG_ERR("%s: restore failed\n", __func__);
+            break;
+        }
+
+        // the last token again on top of the restored cells has to give the same logits
+        llama_kv_cache_seq_rm(ctx, 0, (llama_pos) tokens.size() - 1, -1);
+        ok = kv_swap_prefill(ctx, batch, tokens, tokens.size() - 1, n_batch);
+        if (ok) {
+            const float * again = llama_get_logits_ith(ctx, -1);
+            for (int32_t i = 0; i < n_vocab; i++) {
+                diff = std::max(diff, (double) fabsf(again[i] - logits[i]));
+            }
+        }
+    }
+    llama_batch_free(batch);
+    llama_kv_cache_clear(ctx);
+    if (!ok) {
+        LOG_ERR("%s: llama_decode() or state save/load failed\n", __func__);
+        return 1;
+    }
+    LOG_INF("%s: %zu tokens, best of %d: prefill %.1f ms, swap out %.1f ms (%.1f MiB), swap in %.1f ms\n", __func__,
+            tokens.size(), n_reps, t_prefill, t_out, n_bytes / 1048576.0, t_in);
+    LOG_INF("%s: swap in is %.1fx faster than prefill, max |logit diff| after restore = %g\n", __func__,
+            t_in > 0 ? t_prefill / t_in : 0.0, diff);
+    return 0;
+}
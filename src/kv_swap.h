@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Idle sequences spilled to disk (--kv-swap DIR).
+//
+// swap_out() writes the KV cells of one sequence and the tokens they hold
+// with llama_state_seq_save_file(), after which the caller releases the
+// cells for other sequences. swap_in() reads them back into an empty
+// sequence with llama_state_seq_load_file(); that is a file read and a
+// copy into the cache instead of a forward pass over every token, so it is
+// much cheaper than prefilling the same tokens again (see --kv-swap-bench).
+// The files belong to the running process and are removed on destruction,
+// or, oldest first, when together they grow beyond n_max_bytes.
+
+struct kv_swap_entry {
+    std::string              path;
+    std::vector<llama_token> tokens;
+    size_t                   n_bytes = 0;
+    int32_t                  tag     = 0; // what else the cells depend on, e.g. the adapters they were computed with
+};
+
+struct kv_swap {
+    kv_swap(llama_context * ctx, const std::string & dir, size_t n_max_bytes = 0);
+    ~kv_swap();
+
+    bool enabled() const { return !dir.empty(); }
+
+    // writes the cells of seq_id that hold tokens to a new file, then removes the oldest files
+    // beyond n_max_bytes (the new one too if it alone is larger); the caller releases the cells
+    bool swap_out(llama_seq_id seq_id, const std::vector<llama_token> & tokens, int32_t tag = 0);
+
+    // the swapped entry with tag sharing the longest prefix with prompt, -1 if none shares any
+    int32_t find(const std::vector<llama_token> & prompt, size_t & n_prefix, int32_t tag = 0) const;
+
+    // reads entry i into seq_id, which must be empty and have room for its tokens;
+    // the entry is removed either way
+    bool swap_in(int32_t i, llama_seq_id seq_id, std::vector<llama_token> & tokens);
+
+    const kv_swap_entry & at(int32_t i) const { return entries[i]; }
+
+    // index of the entry written to path, -1 if it is gone; indices shift whenever swap_out()
+    // removes files beyond n_max_bytes, so an index must not be kept across a swap_out()
+    int32_t index_of(const std::string & path) const;
+
+    size_t n_entries() const { return entries.size(); }
+    size_t n_bytes()   const;
+
+private:
+    void remove(int32_t i);
+
+    llama_context * ctx;
+    std::string     dir;
+    size_t          n_max_bytes; // 0 - no limit
+
+    std::vector<kv_swap_entry> entries;
+};
+
+// prefills --kv-swap-bench tokens, then compares swapping them out and in
+// against prefilling them again, and checks that the restored logits match
+int kv_swap_bench(common_params & params, const options & opts, llama_model * model, llama_context * ctx);
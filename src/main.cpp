@@ -5,7 +5,24 @@
 #include "sampling.h"
 #include "llama.h"
 #include "chat-template.hpp"
-
+#include "batch.h"
+#include "embed.h"
+#include "head.h"
+#include "kv_swap.h"
+#include "memory.h"
+#include "options.h"
+#include "output.h"
+#include "perplexity.h"
+#include "prompt_stream.h"
+#include "replay.h"
+#include "requant.h"
+#include "server.h"
+#include "snapshot.h"
+#include "stop.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
@@ -40,9 +57,15 @@ static common_params            * g_params;
 static std::vector<llama_token> * g_input_tokens;
 static std::ostringstream       * g_output_ss;
 static std::vector<llama_token> * g_output_tokens;
+static output_stream            * g_output;
 static bool is_interacting  = false;
 static bool need_insert_eot = false;
 
+// set by the SIGINT handler while the generation loop may be writing to g_output, whose locks a
+// signal handler must not take; the loop flushes and exits when it sees it
+static std::atomic<bool> g_interrupted{false};
+static std::atomic<bool> g_reading_input{false};
+
 static void print_usage(int argc, char ** argv) {
     (void) argc;
 
@@ -50,6 +73,7 @@ static void print_usage(int argc, char ** argv) {
     LOG("\n  text generation:     %s -m your_model.gguf -p \"I believe the meaning of life is\" -n 128\n", argv[0]);
     LOG("\n  chat (conversation): %s -m your_model.gguf -p \"You are a helpful assistant\" -cnv\n", argv[0]);
     LOG("\n");
+    options_print_usage();
 }
 
 static bool file_exists(const std::string & path) {
@@ -64,22 +88,30 @@ static bool file_is_empty(const std::string & path) {
     return f.tellg() == 0;
 }
 
+static void exit_interrupted() {
+    console::cleanup();
+    LOG("\n");
+    common_perf_print(*g_ctx, *g_smpl);
+    trace_write();
+    moe_stats_write();
+
+    // make sure all logs are flushed
+    LOG("Interrupted by user\n");
+    common_log_pause(common_log_main());
+
+    _exit(130);
+}
+
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
 static void sigint_handler(int signo) {
     if (signo == SIGINT) {
         if (!is_interacting && g_params->interactive) {
             is_interacting  = true;
             need_insert_eot = true;
+        } else if (g_output && !g_reading_input) {
+            g_interrupted = true;
         } else {
-            console::cleanup();
-            LOG("\n");
-            common_perf_print(*g_ctx, *g_smpl);
-
-            // make sure all logs are flushed
-            LOG("Interrupted by user\n");
-            common_log_pause(common_log_main());
-
-            _exit(130);
+            exit_interrupted();
         }
     }
 }
@@ -88,12 +120,43 @@ static void sigint_handler(int signo) {
 int main(int argc, char ** argv) {
     common_params params;
     g_params = &params;
-    if (!common_params_parse(argc, argv, params, LLAMA_EXAMPLE_MAIN, print_usage)) {
+    options opts;
+    if (!options_parse(argc, argv, opts)) {
+        return 1;
+    }
+    // embedding mode takes the embedding options (--pooling, --embd-normalize),
+    // perplexity mode --chunks, --kl-divergence-base and --kl-divergence
+    const llama_example ex = !opts.embed.empty() ? LLAMA_EXAMPLE_EMBEDDING
+                           : !opts.ppl.empty()   ? LLAMA_EXAMPLE_PERPLEXITY
+                           :                       LLAMA_EXAMPLE_MAIN;
+    if (!common_params_parse(argc, argv, params, ex, print_usage)) {
         return 1;
     }
 
     common_init();
 
+    if (!opts.trace.empty()) {
+        trace_init(opts.trace, opts.n_trace_events);
+        params.cb_eval = trace_eval_callback;
+        params.cb_eval_user_data = nullptr;
+    }
+
+    if (!opts.requant.empty()) {
+        return requant_run(params, opts);
+    }
+
+    if (!opts.moe_stats.empty()) {
+        moe_stats_init(opts.moe_stats, params.cb_eval);
+        params.cb_eval = moe_stats_eval_callback;
+    }
+
+    if (!opts.serve.empty() && opts.n_choice_head > 0) {
+        // requests with "choices" skip the output head, see head.h; the callback makes the
+        // scheduler offer it every tensor, so it is only installed when asked for
+        head_init(params.cb_eval);
+        params.cb_eval = head_eval_callback;
+    }
+
     auto & sparams = params.sampling;
 
     // save choice to use color for later
@@ -101,20 +164,80 @@ int main(int argc, char ** argv) {
     console::init(params.simple_io, params.use_color);
     atexit([]() { console::cleanup(); });
 
-    if (params.logits_all) {
-        LOG_ERR("************\n");
-        LOG_ERR("%s: please use the 'perplexity' tool for perplexity calculations\n", __func__);
-        LOG_ERR("************\n\n");
+    if (params.logits_all && opts.ppl.empty()) {
+        LOG_ERR("%s: --all-logits is only used for evaluation, use --ppl FILE\n", __func__);
+        return 1;
+    }
+
+    if (!opts.ppl.empty()) {
+        // -c is the chunk length, a batch holds as many whole chunks as fit
+        if (!opts.n_ctx_given || params.n_ctx == 0) {
+            params.n_ctx = 512;
+        }
+        const int n_seq = std::max(1, params.n_batch / params.n_ctx);
+        params.n_parallel = n_seq;
+        params.n_ctx      = params.n_ctx * n_seq;
+        params.n_batch    = std::min(params.n_batch, params.n_ctx);
+        params.logits_all = false; // only the scored half of every chunk asks for logits
+    }
+
+    if (!opts.embed.empty()) {
+        if (opts.embed_format != "matrix" && opts.embed_format != "raw") {
+            LOG_ERR("%s: unknown --embed-format '%s'\n", __func__, opts.embed_format.c_str());
+            return 1;
+        }
+        if (opts.embed_out.empty()) {
+            opts.embed_out = opts.embed + ".embd";
+        }
+        params.embedding = true;
+        // a pooled sequence has to be computed in a single ubatch
+        params.n_ubatch = params.n_batch;
+        if (params.pooling_type == LLAMA_POOLING_TYPE_UNSPECIFIED) {
+            params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        }
+        if (params.n_parallel == 1) {
+            params.n_parallel = 64; // short documents per llama_decode()
+        }
+    }
+
+    if (!opts.batch_in.empty() && params.n_parallel == 1) {
+        // with one sequence there is nothing to batch and no prefix to fork
+        params.n_parallel = 8;
+        LOG_INF("%s: --batch-in without -np, running %d requests at a time\n", __func__, params.n_parallel);
+    }
 
-        return 0;
+    if (opts.n_snapshots > 0 && opts.serve.empty() && opts.batch_in.empty() && opts.embed.empty() && opts.ppl.empty() &&
+        opts.n_kv_swap_bench == 0) {
+        // snapshots pin their KV cells under sequence ids 1 .. n_snapshots
+        params.n_parallel = std::max(params.n_parallel, 1 + opts.n_snapshots);
     }
 
-    if (params.embedding) {
-        LOG_ERR("************\n");
-        LOG_ERR("%s: please use the 'embedding' tool for embedding calculations\n", __func__);
-        LOG_ERR("************\n\n");
+    if (opts.embed.empty()) {
+        // ggml's mul_mat_id gathers the tokens of a micro-batch by expert and runs one matmul per
+        // expert over them, so every micro-batch streams the weights of all experts once: with a
+        // micro-batch as large as the batch, a prefill chunk reads them once instead of
+        // n_batch/n_ubatch times, and every expert gets more rows per matmul. An explicit -ub is kept.
+        // Without flash attention the KQ scores of a micro-batch grow with it (n_head * n_ctx floats
+        // per token), which is the price of the larger micro-batch.
+        const int32_t n_expert = moe_expert_count(params.model);
+        if (n_expert > 0 && (opts.n_moe_ubatch > 0 || !opts.n_ubatch_given)) {
+            const int32_t n_ubatch = opts.n_moe_ubatch > 0 ? std::min(opts.n_moe_ubatch, params.n_batch) : params.n_batch;
+            if (n_ubatch != params.n_ubatch) {
+                LOG_INF("%s: MoE model with %d experts, n_ubatch = %d -> %d\n", __func__, n_expert, params.n_ubatch, n_ubatch);
+                mem_model m;
+                if (!params.flash_attn && n_ubatch > params.n_ubatch && mem_model_read(params.model, m)) {
+                    const int64_t n_ctx = params.n_ctx > 0 ? params.n_ctx : m.n_ctx_train;
+                    LOG_INF("%s: without -fa the KQ scores grow from %.1f to %.1f MiB, --moe-ubatch N or -ub N lowers them\n",
+                            __func__, 4.0 * m.n_head * n_ctx * params.n_ubatch / 1048576.0, 4.0 * m.n_head * n_ctx * n_ubatch / 1048576.0);
+                }
+                params.n_ubatch = n_ubatch;
+            }
+        }
+    }
 
-        return 0;
+    // checked before anything is allocated, so a budget that cannot work fails here
+    if (opts.n_mem_budget > 0 && !mem_plan(params, opts)) {
+        return 1;
     }
 
     if (params.n_ctx != 0 && params.n_ctx < 8) {
@@ -200,6 +323,32 @@ int main(int argc, char ** argv) {
         LOG_WRN("%s: model was trained on only %d context tokens (%d specified)\n", __func__, n_ctx_train, n_ctx);
     }
 
+    if (opts.n_mem_budget > 0) {
+        mem_usage_print(mem_usage_get(params, n_ctx, std::max(1, params.n_parallel)));
+    }
+
+    if (!opts.serve.empty() || !opts.batch_in.empty() || !opts.embed.empty() || !opts.ppl.empty() || !opts.replay.empty() ||
+        opts.n_kv_swap_bench > 0) {
+        if (!opts.batch_in.empty() && opts.batch_out.empty()) {
+            opts.batch_out = opts.batch_in + ".out";
+        }
+        const int ret = !opts.serve.empty()    ? server_run(params, opts, model, ctx)
+                      : !opts.batch_in.empty() ? batch_run (params, opts, model, ctx)
+                      : !opts.embed.empty()    ? embed_run (params, opts, model, ctx)
+                      : !opts.ppl.empty()      ? perplexity_run(params, opts, model, ctx)
+                      : !opts.replay.empty()   ? replay_run(params, opts, model, ctx)
+                      :                          kv_swap_bench(params, opts, model, ctx);
+        trace_write();
+        moe_stats_write();
+
+        llama_backend_free();
+
+        ggml_threadpool_free_fn(threadpool);
+        ggml_threadpool_free_fn(threadpool_batch);
+
+        return ret;
+    }
+
     // auto enable conversation mode if chat template is available
     const bool has_chat_template = chat_templates.has_explicit_template && chat_templates.template_default;
     if (params.conversation_mode == COMMON_CONVERSATION_MODE_AUTO) {
@@ -254,6 +403,17 @@ int main(int argc, char ** argv) {
         }
     }
 
+    if (!opts.prompt_stream.empty()) {
+        // what was prefilled while the prompt arrived is picked up like the tokens of a session file
+        if (!path_session.empty() || params.conversation_mode) {
+            LOG_ERR("%s: --prompt-stream takes a plain prompt, without --prompt-cache or conversation mode\n", __func__);
+            return 1;
+        }
+        if (!prompt_stream_prefill(ctx, opts.prompt_stream, opts.n_prompt_step, params.n_batch, params.prompt, session_tokens)) {
+            return 1;
+        }
+    }
+
     const bool add_bos = llama_vocab_get_add_bos(vocab) && !params.use_jinja;
     if (!llama_model_has_encoder(model)) {
         GGML_ASSERT(!llama_vocab_get_add_eos(vocab));
@@ -279,6 +439,7 @@ int main(int argc, char ** argv) {
             : params.prompt;
         if (params.interactive_first || !params.prompt.empty() || session_tokens.empty()) {
             LOG_DBG("tokenize the prompt\n");
+            TRACE_SCOPE("tokenize");
             embd_inp = common_tokenize(ctx, prompt, true, true);
         } else {
             LOG_DBG("use session tokens\n");
@@ -437,6 +598,10 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    snapshot_store snaps(ctx, 0, opts.n_snapshots);
+    const uint32_t seed = common_sampler_get_seed(smpl);
+    uint32_t n_retry = 0;
+
     LOG_INF("sampler seed: %u\n",     common_sampler_get_seed(smpl));
     LOG_INF("sampler params: \n%s\n", sparams.print().c_str());
     LOG_INF("sampler chain: %s\n",    common_sampler_print(smpl).c_str());
@@ -457,6 +622,18 @@ int main(int argc, char ** argv) {
       //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * grp_attn_n"); // NOLINT
         LOG_INF("self-extend: n_ctx_train = %d, grp_attn_n = %d, grp_attn_w = %d\n", n_ctx_train, ga_n, ga_w);
     }
+
+    if (opts.n_sink > 0) {
+        if (ga_n != 1) {
+            LOG_ERR("%s: --sink cannot be combined with self-extend (--grp-attn-n)\n", __func__);
+            return 1;
+        }
+        if (opts.n_sink + opts.n_sink_evict > n_ctx - 4) {
+            LOG_ERR("%s: --sink %d + --sink-evict %d do not fit into n_ctx = %d\n", __func__, opts.n_sink, opts.n_sink_evict, n_ctx);
+            return 1;
+        }
+        LOG_INF("attention sinks: n_sink = %d, n_sink_evict = %d, window = %d\n", opts.n_sink, opts.n_sink_evict, n_ctx - opts.n_sink);
+    }
     LOG_INF("\n");
 
     if (params.interactive) {
@@ -474,6 +651,9 @@ int main(int argc, char ** argv) {
         LOG_INF(       " - Press Ctrl+C to interject at any time.\n");
 #endif
         LOG_INF(       "%s", control_message);
+        if (opts.n_snapshots > 0) {
+            LOG_INF(   " - /undo drops the last exchange, /retry samples the last reply again.\n");
+        }
         if (params.conversation_mode && params.enable_chat_template && params.prompt.empty()) {
             LOG_INF(   " - Using default system message. To change it, set a different value via -p PROMPT or -f FILE argument.\n");
         }
@@ -491,14 +671,34 @@ int main(int argc, char ** argv) {
     int n_remain           = params.n_predict;
     int n_consumed         = 0;
     int n_session_consumed = 0;
+    int n_accepted         = 0;    // first token of embd_inp the sampler has seen since its last reset
+    bool need_reply_snapshot = true; // snapshot before sampling the reply to new input
+
+    // generation speed over the last n_sink_report sampled tokens (attention-sink mode)
+    const int n_sink_report = 1024;
+    int       n_sink_sampled = 0;
+    int64_t   t_sink_report  = ggml_time_us();
 
     std::vector<int>   input_tokens;  g_input_tokens  = &input_tokens;
     std::vector<int>   output_tokens; g_output_tokens = &output_tokens;
     std::ostringstream output_ss;     g_output_ss     = &output_ss;
     std::ostringstream assistant_ss; // for storing current assistant message, used in conversation mode
 
+    // generated text is written by a separate thread so that a slow reader of stdout never
+    // holds up decoding; console colors go to stdout directly, so they wait for the text before them
+    output_stream out(STDOUT_FILENO, opts.n_out_flush_ms);
+    g_output = &out;
+    console::display_t cur_display = console::reset;
+    auto set_display = [&](console::display_t d) {
+        if (d != cur_display && params.use_color) {
+            out.flush();
+        }
+        cur_display = d;
+        console::set_display(d);
+    };
+
     // the first thing we will do is to output the prompt, so set color accordingly
-    console::set_display(console::prompt);
+    set_display(console::prompt);
     display = params.display_prompt;
 
     std::vector<llama_token> embd;
@@ -513,6 +713,10 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // fed with every token the sampler sees, so a reverse prompt is found without rescanning the history
+    stop_matcher stops(params.antiprompt, antiprompt_token);
+    bool stop_hit = false;
+
     if (llama_model_has_encoder(model)) {
         int enc_input_size = embd_inp.size();
         llama_token * enc_input_buf = embd_inp.data();
@@ -532,8 +736,15 @@ int main(int argc, char ** argv) {
     }
 
     while ((n_remain != 0 && !is_antiprompt) || params.interactive) {
+        if (g_interrupted) {
+            out.flush(100);
+            exit_interrupted();
+        }
+
         // predict
         if (!embd.empty()) {
+            const int64_t t_batch = g_trace_enabled ? ggml_time_us() : 0;
+
             // Note: (n_ctx - 4) here is to match the logic for commandline prompt handling via
             // --prompt or --file which uses the same value.
             int max_embd_size = n_ctx - 4;
@@ -543,12 +754,33 @@ int main(int argc, char ** argv) {
                 const int skipped_tokens = (int) embd.size() - max_embd_size;
                 embd.resize(max_embd_size);
 
-                console::set_display(console::error);
+                set_display(console::error);
                 LOG_WRN("<<input too long: skipped %d token%s>>", skipped_tokens, skipped_tokens != 1 ? "s" : "");
-                console::set_display(console::reset);
+                set_display(console::reset);
             }
 
-            if (ga_n == 1) {
+            if (opts.n_sink > 0) {
+                // infinite text generation via attention sinks:
+                // - keep the first n_sink tokens (the attention sinks) in place
+                // - drop the oldest n_sink_evict tokens of the rolling window and shift the rest down
+                // the K-shift touches the whole cache, so evicting a fixed small step keeps the
+                // amortized per-token cost constant instead of the large stall of discarding n_left/2
+
+                if (n_past + (int) embd.size() >= n_ctx) {
+                    const int n_discard = std::min(n_past - opts.n_sink,
+                            std::max(opts.n_sink_evict, n_past + (int) embd.size() - n_ctx + 1));
+
+                    LOG_DBG("window full, evicting: n_past = %d, n_sink = %d, n_discard = %d\n", n_past, opts.n_sink, n_discard);
+
+                    snaps.clear();
+                    llama_kv_cache_seq_rm (ctx, 0, opts.n_sink            , opts.n_sink + n_discard);
+                    llama_kv_cache_seq_add(ctx, 0, opts.n_sink + n_discard, n_past, -n_discard);
+
+                    n_past -= n_discard;
+
+                    path_session.clear();
+                }
+            } else if (ga_n == 1) {
                 // infinite text generation via context shifting
                 // if we run out of context:
                 // - take the n_keep first tokens from the original prompt (via n_past)
@@ -571,6 +803,7 @@ int main(int argc, char ** argv) {
                     LOG_DBG("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
                             n_past, n_left, n_ctx, params.n_keep, n_discard);
 
+                    snaps.clear();
                     llama_kv_cache_seq_rm (ctx, 0, params.n_keep            , params.n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, 0, params.n_keep + n_discard, n_past, -n_discard);
 
@@ -595,6 +828,7 @@ int main(int argc, char ** argv) {
                     LOG_DBG("div:   [%6d, %6d] / %6d -> [%6d, %6d]\n", ga_i + ib*bd, ga_i + ib*bd + ga_w, ga_n, (ga_i + ib*bd)/ga_n, (ga_i + ib*bd + ga_w)/ga_n);
                     LOG_DBG("shift: [%6d, %6d] + %6d -> [%6d, %6d]\n", ga_i + ib*bd + ga_w, n_past + ib*bd, dd, ga_i + ib*bd + ga_w + dd, n_past + ib*bd + dd);
 
+                    snaps.clear();
                     llama_kv_cache_seq_add(ctx, 0, ga_i,                n_past,              ib*bd);
                     llama_kv_cache_seq_div(ctx, 0, ga_i + ib*bd,        ga_i + ib*bd + ga_w, ga_n);
                     llama_kv_cache_seq_add(ctx, 0, ga_i + ib*bd + ga_w, n_past + ib*bd,      dd);
@@ -629,6 +863,10 @@ int main(int argc, char ** argv) {
                 }
             }
 
+            if (g_trace_enabled) {
+                trace_add("batch", t_batch, ggml_time_us(), (int) embd.size());
+            }
+
             for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
                 int n_eval = (int) embd.size() - i;
                 if (n_eval > params.n_batch) {
@@ -637,6 +875,8 @@ int main(int argc, char ** argv) {
 
                 LOG_DBG("eval: %s\n", string_from(ctx, embd).c_str());
 
+                TRACE_SCOPE("decode", n_eval);
+                trace_decode_begin();
                 if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval))) {
                     LOG_ERR("%s : failed to eval\n", __func__);
                     return 1;
@@ -663,14 +903,40 @@ int main(int argc, char ** argv) {
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
                 need_to_save_session = false;
+                TRACE_SCOPE("session save");
                 llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
 
                 LOG_DBG("saved session to %s\n", path_session.c_str());
             }
 
-            const llama_token id = common_sampler_sample(smpl, ctx, -1);
+            // the last input token is left out of the snapshot and decoded again on /retry
+            // to bring back its logits
+            if (need_reply_snapshot && n_past > 0 && !embd_inp.empty()) {
+                snapshot s;
+                s.n_past     = n_past - 1;
+                s.tokens     = embd_inp;
+                s.pending    = { embd_inp.back() };
+                s.n_consumed = n_consumed;
+                s.n_accepted = n_accepted;
+                s.n_remain   = n_remain;
+                s.n_msgs     = chat_msgs.size();
+                s.reply      = true;
+                s.smpl       = smpl;
+                snaps.save(s);
+            }
+            need_reply_snapshot = false;
+
+            llama_token id;
+            {
+                TRACE_SCOPE("sample");
+
+                id = common_sampler_sample(smpl, ctx, -1);
+
+                common_sampler_accept(smpl, id, /* accept_grammar= */ true);
+            }
 
-            common_sampler_accept(smpl, id, /* accept_grammar= */ true);
+            // anywhere in the new token: it may carry a few more characters after the reverse prompt
+            stop_hit = !stops.empty() && stops.feed(common_token_to_piece(ctx, id)) != std::string::npos;
 
             // LOG_DBG("last: %s\n", string_from(ctx, smpl->prev.to_vector()).c_str());
 
@@ -682,6 +948,13 @@ int main(int argc, char ** argv) {
             // decrement remaining sampling budget
             --n_remain;
 
+            if (opts.n_sink > 0 && ++n_sink_sampled % n_sink_report == 0) {
+                const int64_t t_now = ggml_time_us();
+                LOG_INF("\nsink: %d tokens generated, %.2f tokens/s over the last %d, n_past = %d\n",
+                        n_sink_sampled, 1e6 * n_sink_report / (t_now - t_sink_report), n_sink_report, n_past);
+                t_sink_report = t_now;
+            }
+
             LOG_DBG("n_remain: %d\n", n_remain);
         } else {
             // some user input remains from prompt or interaction, forward it to processing
@@ -692,21 +965,33 @@ int main(int argc, char ** argv) {
                 // push the prompt in the sampling context in order to apply repetition penalties later
                 // for the prompt, we don't apply grammar rules
                 common_sampler_accept(smpl, embd_inp[n_consumed], /* accept_grammar= */ false);
+                if (!stops.empty()) {
+                    stops.feed(common_token_to_piece(ctx, embd_inp[n_consumed]));
+                }
 
                 ++n_consumed;
                 if ((int) embd.size() >= params.n_batch) {
                     break;
                 }
             }
+            // input only counts when it ends with a reverse prompt
+            stop_hit = stops.at_match();
         }
 
         // display text
         if (input_echo && display) {
             for (auto id : embd) {
-                const std::string token_str = common_token_to_piece(ctx, id, params.special);
+                std::string token_str;
+                {
+                    TRACE_SCOPE("detokenize");
+                    token_str = common_token_to_piece(ctx, id, params.special);
+                }
 
                 // Console/Stream Output
-                LOG("%s", token_str.c_str());
+                {
+                    TRACE_SCOPE("output");
+                    out.write(token_str);
+                }
 
                 // Record Displayed Tokens To Log
                 // Note: Generated tokens are created one by one hence this check
@@ -723,47 +1008,20 @@ int main(int argc, char ** argv) {
 
         // reset color to default if there is no pending user input
         if (input_echo && (int) embd_inp.size() == n_consumed) {
-            console::set_display(console::reset);
+            set_display(console::reset);
             display = true;
         }
 
         // if not currently processing queued inputs;
         if ((int) embd_inp.size() <= n_consumed) {
-            // check for reverse prompt in the last n_prev tokens
+            // check for a reverse prompt in the text or a reverse-prompt token
             if (!params.antiprompt.empty()) {
-                const int n_prev = 32;
-                const std::string last_output = common_sampler_prev_str(smpl, ctx, n_prev);
-
-                is_antiprompt = false;
-                // Check if each of the reverse prompts appears at the end of the output.
-                // If we're not running interactively, the reverse prompt might be tokenized with some following characters
-                // so we'll compensate for that by widening the search window a bit.
-                for (std::string & antiprompt : params.antiprompt) {
-                    size_t extra_padding = params.interactive ? 0 : 2;
-                    size_t search_start_pos = last_output.length() > static_cast<size_t>(antiprompt.length() + extra_padding)
-                        ? last_output.length() - static_cast<size_t>(antiprompt.length() + extra_padding)
-                        : 0;
-
-                    if (last_output.find(antiprompt, search_start_pos) != std::string::npos) {
-                        if (params.interactive) {
-                            is_interacting = true;
-                        }
-                        is_antiprompt = true;
-                        break;
-                    }
-                }
-
-                // check for reverse prompt using special tokens
-                llama_token last_token = common_sampler_last(smpl);
-                if (std::find(antiprompt_token.begin(), antiprompt_token.end(), last_token) != antiprompt_token.end()) {
+                is_antiprompt = stop_hit || stops.is_stop_token(common_sampler_last(smpl));
+                if (is_antiprompt) {
                     if (params.interactive) {
                         is_interacting = true;
                     }
-                    is_antiprompt = true;
-                }
-
-                if (is_antiprompt) {
-                    LOG_DBG("found antiprompt: %s\n", last_output.c_str());
+                    LOG_DBG("found antiprompt\n");
                 }
             }
 
@@ -783,7 +1041,7 @@ int main(int argc, char ** argv) {
                         chat_add_and_format("assistant", assistant_ss.str());
                     }
                     is_interacting = true;
-                    LOG("\n");
+                    out.write("\n");
                 }
             }
 
@@ -797,7 +1055,20 @@ int main(int argc, char ** argv) {
                 LOG_DBG("waiting for user input\n");
 
                 if (params.conversation_mode) {
-                    LOG("\n> ");
+                    out.write("\n> ");
+                }
+
+                {
+                    snapshot s;
+                    s.n_past     = n_past;
+                    s.tokens     = embd_inp;
+                    s.pending    = embd;
+                    s.n_consumed = n_consumed;
+                    s.n_accepted = n_accepted;
+                    s.n_remain   = n_remain;
+                    s.n_msgs     = chat_msgs.size();
+                    s.smpl       = smpl;
+                    snaps.save(s);
                 }
 
                 if (params.input_prefix_bos) {
@@ -808,31 +1079,81 @@ int main(int argc, char ** argv) {
                 std::string buffer;
                 if (!params.input_prefix.empty() && !params.conversation_mode) {
                     LOG_DBG("appending input prefix: '%s'\n", params.input_prefix.c_str());
-                    LOG("%s", params.input_prefix.c_str());
+                    out.write(params.input_prefix);
                 }
 
                 // color user input only
-                console::set_display(console::user_input);
+                set_display(console::user_input);
                 display = params.display_prompt;
 
-                std::string line;
-                bool another_line = true;
-                do {
-                    another_line = console::readline(line, params.multiline_input);
-                    buffer += line;
-                } while (another_line);
+                for (;;) {
+                    std::string line;
+                    bool another_line = true;
+                    do {
+                        out.flush();
+                        g_reading_input = true;
+                        another_line = console::readline(line, params.multiline_input);
+                        g_reading_input = false;
+                        buffer += line;
+                    } while (another_line);
+
+                    // /undo and /retry roll the session back to a snapshot instead of taking input
+                    const std::string cmd = string_strip(buffer);
+                    if (opts.n_snapshots == 0 || (cmd != "/undo" && cmd != "/retry")) {
+                        break;
+                    }
+                    buffer.clear();
+                    const int32_t i = cmd == "/undo" ? snaps.find(false, 1) : snaps.find(true);
+                    snapshot s;
+                    if (i < 0 || !snaps.restore(i, s)) {
+                        out.write("[nothing to " + cmd.substr(1) + "]\n> ");
+                        continue;
+                    }
+                    n_past     = s.n_past;
+                    embd       = s.pending;
+                    embd_inp   = s.tokens;
+                    n_consumed = s.n_consumed;
+                    n_accepted = s.n_accepted;
+                    n_remain   = s.n_remain;
+                    chat_msgs.resize(s.n_msgs);
+                    assistant_ss.str("");
+                    common_sampler_free(smpl);
+                    smpl = s.smpl;
+                    stops.reset();
+                    // the prompt cache no longer matches the KV cache
+                    path_session.clear();
+                    session_tokens.clear();
+                    n_session_consumed = 0;
+                    if (cmd == "/undo") {
+                        out.write("[undo]\n> ");
+                        continue;
+                    }
+                    // the reply snapshot is taken again right before sampling
+                    snaps.pop();
+                    common_sampler * alt = snaps.reseed(s, model, sparams, seed + ++n_retry);
+                    if (alt) {
+                        common_sampler_free(smpl);
+                        smpl = alt;
+                    }
+                    need_reply_snapshot = true;
+                    is_interacting = false; // keeps the sampler from being reset below
+                    out.write("[retry]\n");
+                    break;
+                }
 
                 // done taking input, reset color
-                console::set_display(console::reset);
+                set_display(console::reset);
                 display = true;
 
                 // Add tokens to embd only if the input buffer is non-empty
                 // Entering a empty line lets the user pass control back
                 if (buffer.length() > 1) {
+                    TRACE_SCOPE("tokenize");
+
                     // append input suffix if any
                     if (!params.input_suffix.empty() && !params.conversation_mode) {
                         LOG_DBG("appending input suffix: '%s'\n", params.input_suffix.c_str());
-                        LOG("%s", params.input_suffix.c_str());
+                        out.write(params.input_suffix);
                     }
 
                     LOG_DBG("buffer: '%s'\n", buffer.c_str());
@@ -873,6 +1194,7 @@ int main(int argc, char ** argv) {
 
                     // reset assistant message
                     assistant_ss.str("");
+                    need_reply_snapshot = true;
 
                     n_remain -= line_inp.size();
                     LOG_DBG("n_remain: %d\n", n_remain);
@@ -886,6 +1208,7 @@ int main(int argc, char ** argv) {
             if (n_past > 0) {
                 if (is_interacting) {
                     common_sampler_reset(smpl);
+                    n_accepted = n_consumed;
                 }
                 is_interacting = false;
             }
@@ -893,7 +1216,7 @@ int main(int argc, char ** argv) {
 
         // end of generation
         if (!embd.empty() && llama_vocab_is_eog(vocab, embd.back()) && !(params.interactive)) {
-            LOG(" [end of text]\n");
+            out.write(" [end of text]\n");
             break;
         }
 
@@ -905,13 +1228,22 @@ int main(int argc, char ** argv) {
         }
     }
 
+    out.write("\n");
+    out.flush();
+    g_output = nullptr; // nothing is written to it anymore, so SIGINT can exit right away
+    LOG_DBG("%s: output: %llu writev calls, %llu bytes spilled\n", __func__,
+            (unsigned long long) out.n_syscalls(), (unsigned long long) out.n_spilled());
+
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
-        LOG("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
+        LOG("%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
+        TRACE_SCOPE("session save");
         llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
     }
 
-    LOG("\n\n");
+    LOG("\n");
     common_perf_print(ctx, smpl);
+    trace_write();
+    moe_stats_write();
 
     common_sampler_free(smpl);
 
@@ -0,0 +1,249 @@
+#include "memory.h"
+
+#include "gguf.h"
+#include "log.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const size_t MiB = 1024 * 1024;
+
+// runtime, tokenizer, thread stacks and the like, beyond what mem_plan() accounts for
+static const size_t MEM_OVERHEAD = 64 * MiB;
+
+// integer value of key, the largest element for per-layer arrays
+static int64_t gguf_int(const gguf_context * g, const std::string & key, int64_t def) {
+    const int64_t i = gguf_find_key(g, key.c_str());
+    if (i < 0) {
+        return def;
+    }
+    switch (gguf_get_kv_type(g, i)) {
+        case GGUF_TYPE_UINT32: return gguf_get_val_u32(g, i);
+        case GGUF_TYPE_INT32:  return gguf_get_val_i32(g, i);
+        case GGUF_TYPE_ARRAY: {
+            const gguf_type t = gguf_get_arr_type(g, i);
+            if (t != GGUF_TYPE_UINT32 && t != GGUF_TYPE_INT32) {
+                return def;
+            }
+            const int32_t * v = (const int32_t *) gguf_get_arr_data(g, i);
+            int64_t r = 0;
+            for (size_t j = 0; j < gguf_get_arr_n(g, i); j++) {
+                r = std::max(r, (int64_t) v[j]);
+            }
+            return r;
+        }
+        default: return def;
+    }
+}
+
+bool mem_model_read(const std::string & path, mem_model & m) {
+    gguf_init_params ip = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * g = gguf_init_from_file(path.c_str(), ip);
+    if (!g) {
+        return false;
+    }
+    const int64_t i_arch = gguf_find_key(g, "general.architecture");
+    const std::string arch = i_arch >= 0 ? gguf_get_val_str(g, i_arch) : "";
+    m = mem_model();
+    for (int64_t i = 0; i < gguf_get_n_tensors(g); i++) {
+        m.n_weights += gguf_get_tensor_size(g, i);
+    }
+    m.n_layer     = gguf_int(g, arch + ".block_count", 0);
+    m.n_embd      = gguf_int(g, arch + ".embedding_length", 0);
+    m.n_head      = gguf_int(g, arch + ".attention.head_count", 0);
+    m.n_head_kv   = gguf_int(g, arch + ".attention.head_count_kv", m.n_head);
+    m.n_embd_k    = gguf_int(g, arch + ".attention.key_length",   m.n_head > 0 ? m.n_embd / m.n_head : 0);
+    m.n_embd_v    = gguf_int(g, arch + ".attention.value_length", m.n_embd_k);
+    m.n_ff        = gguf_int(g, arch + ".feed_forward_length", 4 * m.n_embd);
+    m.n_ctx_train = (int32_t) gguf_int(g, arch + ".context_length", 0);
+    const int64_t i_tokens = gguf_find_key(g, "tokenizer.ggml.tokens");
+    m.n_vocab     = i_tokens >= 0 ? (int64_t) gguf_get_arr_n(g, i_tokens) : 0;
+    gguf_free(g);
+    return m.n_layer > 0 && m.n_embd > 0;
+}
+
+size_t mem_kv_bytes(const mem_model & m, int64_t n_ctx, ggml_type type_k, ggml_type type_v) {
+    return (size_t) (m.n_layer * n_ctx * m.n_head_kv) * (ggml_row_size(type_k, m.n_embd_k) + ggml_row_size(type_v, m.n_embd_v));
+}
+
+size_t mem_compute_bytes(const mem_model & m, int64_t n_ctx, int64_t n_ubatch, int64_t n_outputs, bool flash_attn) {
+    // the largest tensors alive at once: the scores and their softmax (unless flash attention
+    // fuses them), or the FFN up and gate projections, or the logits; plus a few rows of the
+    // residual stream, and the logits copied out for every sequence
+    const int64_t n_attn = flash_attn ? 0 : 2 * m.n_head * n_ctx;
+    const int64_t n_peak = std::max({ n_attn, 3 * m.n_ff, m.n_vocab });
+    return sizeof(float) * (size_t) (n_ubatch * (n_peak + 4 * m.n_embd) + n_outputs * m.n_vocab);
+}
+
+size_t mem_sampler_bytes(const mem_model & m) {
+    // the candidate array and a working copy of it
+    return 2 * sizeof(llama_token_data) * (size_t) m.n_vocab;
+}
+
+// value of a "Name:   123 kB" line of a /proc file, in bytes
+static size_t proc_kb(const char * path, const char * name) {
+    FILE * f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    const size_t n = strlen(name);
+    char line[256];
+    size_t v = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, name, n) == 0 && line[n] == ':') {
+            v = strtoull(line + n + 1, nullptr, 10) * 1024;
+            break;
+        }
+    }
+    fclose(f);
+    return v;
+}
+
+size_t mem_rss() {
+    return proc_kb("/proc/self/status", "VmRSS");
+}
+
+size_t mem_rss_peak() {
+    return proc_kb("/proc/self/status", "VmHWM");
+}
+
+// resident bytes of the mappings of file
+static size_t mem_mapped(const std::string & file) {
+    char real[PATH_MAX];
+    if (!realpath(file.c_str(), real)) {
+        return 0;
+    }
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[PATH_MAX + 256];
+    bool   in_file = false;
+    size_t n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        const char * colon = strchr(line, ':');
+        const char * space = strchr(line, ' ');
+        if (space && (!colon || colon > space)) {
+            // a mapping: "start-end perms offset dev inode path"
+            line[strcspn(line, "\n")] = 0;
+            const char * p = strchr(line, '/');
+            in_file = p && strcmp(p, real) == 0;
+        } else if (in_file && strncmp(line, "Rss:", 4) == 0) {
+            n += strtoull(line + 4, nullptr, 10) * 1024;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+mem_usage mem_usage_get(const common_params & params, int64_t n_ctx, int32_t n_samplers) {
+    mem_usage u;
+    mem_model m;
+    mem_model_read(params.model, m);
+    if (params.use_mmap) {
+        u.weights_mapped = mem_mapped(params.model);
+    } else {
+        u.weights_anon = m.n_weights;
+    }
+    u.kv       = mem_kv_bytes(m, n_ctx, params.cache_type_k, params.cache_type_v);
+    u.samplers = n_samplers * mem_sampler_bytes(m);
+    const size_t anon  = proc_kb("/proc/self/status", "RssAnon");
+    const size_t known = u.weights_anon + u.kv + u.samplers;
+    u.compute  = anon > known ? anon - known : 0;
+    u.rss      = mem_rss();
+    u.rss_peak = mem_rss_peak();
+    return u;
+}
+
+void mem_usage_print(const mem_usage & u) {
+    LOG_INF("%s: resident %.1f MiB, peak %.1f MiB\n", __func__, u.rss / (double) MiB, u.rss_peak / (double) MiB);
+    LOG_INF("%s:   weights, mapped     %10.1f MiB\n", __func__, u.weights_mapped / (double) MiB);
+    LOG_INF("%s:   weights, anonymous  %10.1f MiB\n", __func__, u.weights_anon   / (double) MiB);
+    LOG_INF("%s:   KV cache            %10.1f MiB\n", __func__, u.kv             / (double) MiB);
+    LOG_INF("%s:   samplers            %10.1f MiB\n", __func__, u.samplers       / (double) MiB);
+    LOG_INF("%s:   compute and other   %10.1f MiB\n", __func__, u.compute        / (double) MiB);
+}
+
+bool mem_plan(common_params & params, const options & opts) {
+    mem_model m;
+    if (!mem_model_read(params.model, m)) {
+        LOG_ERR("%s: failed to read the metadata of '%s'\n", __func__, params.model.c_str());
+        return false;
+    }
+    const size_t budget = (size_t) opts.n_mem_budget * MiB;
+    const size_t fixed  = m.n_weights + MEM_OVERHEAD;
+    const bool   serve  = !opts.serve.empty();
+    const bool   ppl    = !opts.ppl.empty();
+    const bool   embed  = !opts.embed.empty();
+    // perplexity: main() sized n_ctx for n_parallel chunks, only how many of them run at once is planned
+    const int64_t n_chunk_ctx = ppl ? params.n_ctx / std::max(1, params.n_parallel) : 0;
+    // an explicit -c is kept, only the micro-batch is lowered to make it fit
+    const bool    ctx_given = opts.n_ctx_given && params.n_ctx > 0 && !ppl;
+    const int64_t n_seq_ctx = opts.n_mem_seq_ctx;
+    const int64_t n_ctx_min = ppl ? n_chunk_ctx : ctx_given ? params.n_ctx : serve ? n_seq_ctx : 512;
+    const int64_t n_ctx_max = serve ? 64 * n_seq_ctx : (m.n_ctx_train > 0 ? m.n_ctx_train : params.n_ctx);
+
+    int64_t n_ubatch = std::min(params.n_ubatch, params.n_batch);
+    int64_t n_ctx    = 0;
+    int64_t n_seq    = 1;
+    for (;;) {
+        auto cost = [&](int64_t n_ctx, int64_t n_seq, int64_t n_outputs) {
+            return fixed + mem_kv_bytes(m, n_ctx, params.cache_type_k, params.cache_type_v) +
+                   mem_compute_bytes(m, n_ctx, n_ubatch, n_outputs, params.flash_attn) + n_seq * mem_sampler_bytes(m);
+        };
+        n_ctx = 0;
+        n_seq = 1;
+        if (ppl) {
+            // the scored half of every chunk in a batch has logits
+            for (int64_t s = 1; s <= params.n_parallel; s++) {
+                const int64_t c = s * n_chunk_ctx;
+                if (cost(c, 1, std::min<int64_t>(params.n_batch, c) / 2) > budget) {
+                    break;
+                }
+                n_ctx = c;
+                n_seq = s;
+            }
+        } else if (ctx_given) {
+            n_seq = serve ? params.n_parallel : 1;
+            n_ctx = cost(params.n_ctx, n_seq, n_seq) <= budget ? params.n_ctx : 0;
+        } else if (serve) {
+            while ((n_seq + 1) * n_seq_ctx <= n_ctx_max && cost((n_seq + 1) * n_seq_ctx, n_seq + 1, n_seq + 1) <= budget) {
+                n_seq++;
+            }
+            n_ctx = cost(n_seq_ctx, 1, 1) <= budget ? n_seq * n_seq_ctx : 0;
+        } else {
+            for (int64_t c = 256; c <= n_ctx_max && cost(c, 1, 1) <= budget; c += 256) {
+                n_ctx = c;
+            }
+        }
+        // a smaller micro-batch leaves room for more context
+        if (n_ctx >= n_ctx_min || n_ubatch <= 32) {
+            break;
+        }
+        n_ubatch /= 2;
+    }
+    if (n_ctx < n_ctx_min) {
+        LOG_ERR("%s: %d MiB do not hold the weights (%.0f MiB) and a context of %lld tokens\n", __func__,
+                opts.n_mem_budget, m.n_weights / (double) MiB, (long long) n_ctx_min);
+        return false;
+    }
+    params.n_ctx    = (int32_t) n_ctx;
+    params.n_ubatch = (int32_t) n_ubatch;
+    // a pooled sequence has to be computed in a single micro-batch, so embeddings keep n_batch == n_ubatch
+    params.n_batch  = (int32_t) (embed ? n_ubatch : std::max(n_ubatch, std::min((int64_t) params.n_batch, n_ctx)));
+    if (serve || ppl) {
+        params.n_parallel = (int32_t) n_seq;
+    }
+    LOG_INF("%s: budget %d MiB: weights %.0f MiB, n_ctx = %d, n_batch = %d, n_ubatch = %d, n_parallel = %d\n", __func__,
+            opts.n_mem_budget, m.n_weights / (double) MiB, params.n_ctx, params.n_batch, params.n_ubatch, params.n_parallel);
+    return true;
+}
+
+size_t mem_context_bytes(const mem_model & m, const common_params & params) {
+    return mem_kv_bytes(m, params.n_ctx, params.cache_type_k, params.cache_type_v) +
+           mem_compute_bytes(m, params.n_ctx, std::min(params.n_ubatch, params.n_batch), params.n_parallel, params.flash_attn) +
+           params.n_parallel * mem_sampler_bytes(m);
+}
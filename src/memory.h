@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Memory accounting and sizing to a RAM budget (--mem-budget MiB).
+//
+// mem_usage_get() splits what the process holds in RAM by kind: weights
+// mapped from the model file (page cache, shared by every process that maps
+// the same file) and weights copied to anonymous memory (--no-mmap), the KV
+// cache, the samplers, and the compute buffers with everything else
+// anonymous. The mapped share is the resident size of the file's mappings
+// in /proc/self/smaps; KV cache and samplers follow from their shapes.
+//
+// mem_plan() runs before anything is allocated. From the GGUF metadata it
+// derives the size of the weights, the KV bytes per token and the compute
+// buffer for a micro-batch, then picks the largest context (and, when
+// serving, the most --mem-seq-ctx sized sequences) that fit beside the
+// weights, lowering -ub/-b before giving up on context. An explicit -c is
+// kept as it is; perplexity plans how many chunks run in parallel, and
+// embeddings keep -b equal to -ub. It refuses to
+// start when not even a small context fits, and the server turns requests
+// away while the process is over budget, instead of failing an allocation
+// in the middle of a decode.
+
+// the shapes that decide memory use, from the GGUF metadata of a model
+struct mem_model {
+    size_t  n_weights   = 0; // bytes of tensor data
+    int64_t n_layer     = 0;
+    int64_t n_embd      = 0;
+    int64_t n_head      = 0;
+    int64_t n_head_kv   = 0;
+    int64_t n_embd_k    = 0; // per head
+    int64_t n_embd_v    = 0;
+    int64_t n_ff        = 0;
+    int64_t n_vocab     = 0;
+    int32_t n_ctx_train = 0;
+};
+
+bool mem_model_read(const std::string & path, mem_model & m);
+
+size_t mem_kv_bytes(const mem_model & m, int64_t n_ctx, ggml_type type_k, ggml_type type_v);
+size_t mem_compute_bytes(const mem_model & m, int64_t n_ctx, int64_t n_ubatch, int64_t n_outputs, bool flash_attn); // estimate
+size_t mem_sampler_bytes(const mem_model & m);
+
+// KV cache, compute buffers and samplers of a context created with params
+size_t mem_context_bytes(const mem_model & m, const common_params & params);
+
+struct mem_usage {
+    size_t weights_mapped = 0;
+    size_t weights_anon   = 0;
+    size_t kv             = 0;
+    size_t samplers       = 0;
+    size_t compute        = 0; // and all other anonymous memory
+    size_t rss            = 0;
+    size_t rss_peak       = 0;
+};
+
+// for params.model with a context of n_ctx and n_samplers samplers
+mem_usage mem_usage_get(const common_params & params, int64_t n_ctx, int32_t n_samplers);
+void      mem_usage_print(const mem_usage & u);
+
+// resident and peak resident bytes of the process
+size_t mem_rss();
+size_t mem_rss_peak();
+
+// sets n_ctx, n_batch, n_ubatch and, with --serve, n_parallel of params to fit opts.n_mem_budget
+bool mem_plan(common_params & params, const options & opts);
@@ -0,0 +1,202 @@
+#include "models.h"
+
+#include "gguf.h"
+#include "log.h"
+
+#include <cstring>
+
+std::string model_name_from_path(const std::string & path) {
+    const size_t slash = path.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    const size_t dot = name.rfind(".gguf");
+    if (dot != std::string::npos && dot + 5 == name.size()) {
+        name.resize(dot);
+    }
+    return name;
+}
+
+static uint64_t fnv1a(uint64_t h, const void * data, size_t n) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// the pre-tokenizer and the BPE merges, which llama_vocab does not expose, from the GGUF at path;
+// a file that cannot be read gets a fingerprint of its own
+static uint64_t gguf_tokenizer_fingerprint(uint64_t h, const std::string & path) {
+    gguf_init_params ip = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * g = gguf_init_from_file(path.c_str(), ip);
+    if (!g) {
+        return fnv1a(h, path.c_str(), path.size() + 1);
+    }
+    const int64_t i_pre = gguf_find_key(g, "tokenizer.ggml.pre");
+    const char * pre = i_pre >= 0 ? gguf_get_val_str(g, i_pre) : "";
+    h = fnv1a(h, pre, strlen(pre) + 1);
+    const int64_t i_merges = gguf_find_key(g, "tokenizer.ggml.merges");
+    const size_t  n_merges = i_merges >= 0 ? gguf_get_arr_n(g, i_merges) : 0;
+    for (size_t i = 0; i < n_merges; i++) {
+        const char * merge = gguf_get_arr_str(g, i_merges, i);
+        h = fnv1a(h, merge, strlen(merge) + 1);
+    }
+    gguf_free(g);
+    return h;
+}
+
+// everything that decides how text is tokenized and detokenized
+static uint64_t vocab_fingerprint(const llama_vocab * vocab, const std::string & path) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    const int32_t header[] = {
+        (int32_t) llama_vocab_type(vocab), llama_vocab_n_tokens(vocab),
+        llama_vocab_bos(vocab), llama_vocab_eos(vocab), llama_vocab_eot(vocab),
+        llama_vocab_get_add_bos(vocab), llama_vocab_get_add_eos(vocab),
+    };
+    h = fnv1a(h, header, sizeof(header));
+    for (llama_token id = 0; id < llama_vocab_n_tokens(vocab); id++) {
+        const char * text = llama_vocab_get_text(vocab, id);
+        const float  score = llama_vocab_get_score(vocab, id);
+        const int32_t attr = (int32_t) llama_vocab_get_attr(vocab, id);
+        h = fnv1a(h, text, strlen(text) + 1);
+        h = fnv1a(h, &score, sizeof(score));
+        h = fnv1a(h, &attr, sizeof(attr));
+    }
+    return gguf_tokenizer_fingerprint(h, path);
+}
+
+model_registry::model_registry(common_params & params) : params(params) {}
+
+model_registry::~model_registry() {
+    for (auto & e : entries) {
+        if (e.model && e.owned && e.n_refs > 0) {
+            LOG_WRN("%s: model '%s' still has %d users\n", __func__, e.name.c_str(), e.n_refs);
+        }
+    }
+}
+
+model_entry * model_registry::find(const std::string & name) {
+    for (auto & e : entries) {
+        if (e.name == name) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+void model_registry::add_loaded(const std::string & name, const std::string & path, llama_model * model) {
+    model_entry e;
+    e.name  = name;
+    e.path  = path;
+    e.model = model;
+    e.owned = false;
+    entries.push_back(e);
+    entries.back().vocab_id = vocab_id(model);
+}
+
+bool model_registry::add_list(const std::string & list) {
+    for (const std::string & item : string_split<std::string>(list, ',')) {
+        const size_t eq = item.find('=');
+        const std::string name = eq == std::string::npos ? model_name_from_path(item) : item.substr(0, eq);
+        const std::string path = eq == std::string::npos ? item : item.substr(eq + 1);
+        if (name.empty() || path.empty() || find(name)) {
+            LOG_ERR("%s: bad or duplicate model '%s'\n", __func__, item.c_str());
+            return false;
+        }
+        model_entry e;
+        e.name = name;
+        e.path = path;
+        entries.push_back(e);
+    }
+    return true;
+}
+
+llama_model * model_registry::acquire(const std::string & name) {
+    model_entry * e = find(name);
+    if (!e) {
+        return nullptr;
+    }
+    if (!e->model) {
+        // another name may already have the same file mapped
+        for (const auto & other : entries) {
+            if (other.model && other.path == e->path) {
+                e->model    = other.model;
+                e->owned    = other.owned;
+                e->n_refs   = other.n_refs;
+                e->vocab_id = other.vocab_id;
+                break;
+            }
+        }
+    }
+    if (!e->model) {
+        llama_model_params mparams = common_model_params_to_llama(params);
+        e->model = llama_model_load_from_file(e->path.c_str(), mparams);
+        if (!e->model) {
+            LOG_ERR("%s: failed to load '%s' from '%s'\n", __func__, name.c_str(), e->path.c_str());
+            return nullptr;
+        }
+        e->owned    = true;
+        e->n_refs   = 0;
+        e->vocab_id = vocab_id(e->model);
+        LOG_INF("%s: loaded '%s' from '%s', vocab %d\n", __func__, name.c_str(), e->path.c_str(), e->vocab_id);
+    }
+    llama_model * model = e->model;
+    for (auto & other : entries) {
+        if (other.model == model) {
+            other.n_refs++;
+        }
+    }
+    return model;
+}
+
+void model_registry::release(llama_model * model) {
+    bool last = false;
+    bool owned = false;
+    for (auto & e : entries) {
+        if (e.model == model) {
+            last  = --e.n_refs == 0;
+            owned = e.owned;
+        }
+    }
+    if (!last || !owned) {
+        return;
+    }
+    for (auto & e : entries) {
+        if (e.model == model) {
+            e.model = nullptr;
+        }
+    }
+    llama_model_free(model);
+}
+
+int32_t model_registry::vocab_id(const llama_model * model) const {
+    for (const auto & e : entries) {
+        if (e.model == model && e.vocab_id >= 0) {
+            return e.vocab_id;
+        }
+    }
+    const uint64_t h = vocab_fingerprint(llama_model_get_vocab(model), path_of(model));
+    for (size_t i = 0; i < vocab_hashes.size(); i++) {
+        if (vocab_hashes[i] == h) {
+            return (int32_t) i;
+        }
+    }
+    vocab_hashes.push_back(h);
+    return (int32_t) vocab_hashes.size() - 1;
+}
+
+std::string model_registry::path_of(const llama_model * model) const {
+    for (const auto & e : entries) {
+        if (e.model == model) {
+            return e.path;
+        }
+    }
+    return "";
+}
+
+std::vector<std::string> model_registry::names() const {
+    std::vector<std::string> names;
+    for (const auto & e : entries) {
+        names.push_back(e.name);
+    }
+    return names;
+}
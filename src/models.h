@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Registry of the models one process serves (--models NAME=PATH,...).
+//
+// Names map to GGUF paths; every path is loaded once (memory-mapped, so the
+// weights live in the page cache) and reference counted: names that point
+// at the same file share one llama_model, and the model is freed when its
+// last user releases it. Vocabularies are fingerprinted on load, with the
+// pre-tokenizer and BPE merges read from the GGUF: models with identical
+// tokenizers get the same vocab_id. Every model still tokenizes with its
+// own vocab, which llama.cpp keeps inside llama_model, so sharing one
+// would save nothing.
+
+struct model_entry {
+    std::string   name;
+    std::string   path;
+    llama_model * model    = nullptr;
+    bool          owned    = true; // loaded by the registry (false - handed in by the caller)
+    int32_t       n_refs   = 0;
+    int32_t       vocab_id = -1;
+};
+
+struct model_registry {
+    explicit model_registry(common_params & params);
+    ~model_registry();
+
+    // registers a model the caller already loaded; it is never freed by the registry
+    void add_loaded(const std::string & name, const std::string & path, llama_model * model);
+
+    // parses NAME=PATH[,NAME=PATH...] and registers the names without loading
+    bool add_list(const std::string & list);
+
+    // the model for name, loaded on first use; every acquire needs a release
+    llama_model * acquire(const std::string & name);
+    void release(llama_model * model);
+
+    // models with the same vocab_id tokenize identically
+    int32_t vocab_id(const llama_model * model) const;
+
+    // the file model was loaded from
+    std::string path_of(const llama_model * model) const;
+
+    std::vector<std::string> names() const;
+
+private:
+    model_entry * find(const std::string & name);
+
+    common_params & params;
+
+    std::vector<model_entry> entries;
+    mutable std::vector<uint64_t> vocab_hashes; // indexed by vocab_id
+};
+
+// file name without directories and extension, the default model name
+std::string model_name_from_path(const std::string & path);
@@ -0,0 +1,108 @@
+#include "options.h"
+
+#include "log.h"
+
+#include <cstdlib>
+#include <cstring>
+
+struct option_def {
+    const char  * name;
+    int32_t       options::* i; // integer option or
+    std::string   options::* s; // string option
+    int32_t       min;
+    const char  * help;
+};
+
+static const option_def options_defs[] = {
+    { "--sink",       &options::n_sink,       nullptr, 0, "N     keep N attention-sink tokens and a rolling window instead of context shift (default: 0, disabled)" },
+    { "--sink-evict", &options::n_sink_evict, nullptr, 1, "N     tokens evicted from the rolling window per step (default: 32)" },
+    { "--serve",      nullptr, &options::serve,        0, "ADDR  serve HTTP on a Unix socket path or a 127.0.0.1 port instead of running interactively" },
+    { "--prefill-chunk", &options::n_prefill_chunk, nullptr, 1, "N  prompt tokens per step while other requests generate (default: 256)" },
+    { "--choice-head",   &options::n_choice_head, nullptr, 0, "N  1 - score \"choices\" from their rows of the output matrix, skipping the output matmul (default: 0)" },
+    { "--batch-in",      nullptr, &options::batch_in,    0, "FILE  run the JSONL requests in FILE as an offline batch" },
+    { "--batch-out",     nullptr, &options::batch_out,   0, "FILE  append JSONL results to FILE, skipping ids already there (default: <batch-in>.out)" },
+    { "--embed",         nullptr, &options::embed,       0, "FILE  write pooled embeddings of every line of FILE instead of generating" },
+    { "--embed-out",     nullptr, &options::embed_out,   0, "FILE  embeddings output (default: <embed>.embd)" },
+    { "--embed-format",  nullptr, &options::embed_format, 0, "FMT  matrix (16-byte header + float32 rows) or raw (float32 rows) (default: matrix)" },
+    { "--trace",         nullptr, &options::trace,       0, "FILE  write per-token phase timings as Chrome trace JSON (default: off)" },
+    { "--trace-events",  &options::n_trace_events, nullptr, 1, "N  trace ring buffer capacity in events (default: 65536)" },
+    { "--ppl",           nullptr, &options::ppl,         0, "FILE  report perplexity of FILE (with --kl-divergence-base/--kl-divergence: KL divergence)" },
+    { "--moe-stats",     nullptr, &options::moe_stats,   0, "FILE  add expert routing and activation statistics of this run to FILE" },
+    { "--requant",       nullptr, &options::requant,     0, "FILE  write -m to FILE with experts requantized by --moe-stats, then exit" },
+    { "--moe-hot",       &options::moe_hot, nullptr,     1, "N  an expert is hot at N% of the uniform routing share (default: 200)" },
+    { "--moe-hot-type",  nullptr, &options::moe_hot_type, 0, "TYPE  experts of layers routed mostly to hot experts (default: q8_0)" },
+    { "--moe-cold-type", nullptr, &options::moe_cold_type, 0, "TYPE  experts of the other layers (default: q4_K)" },
+    { "--snapshots",     &options::n_snapshots, nullptr, 0, "N  keep N in-memory snapshots for /undo and /retry in interactive mode (default: 0, off)" },
+    { "--kv-swap",       nullptr, &options::kv_swap,     0, "DIR  write the KV cache of idle server slots to DIR and read it back when needed" },
+    { "--kv-swap-idle",  &options::n_kv_swap_idle, nullptr, 0, "N  seconds a slot is idle before it is swapped out (default: 60)" },
+    { "--kv-swap-max",   &options::n_kv_swap_max, nullptr, 0, "MiB  remove the oldest swapped sessions beyond this size, 0 - no limit (default: 8192)" },
+    { "--kv-swap-bench", &options::n_kv_swap_bench, nullptr, 0, "N  compare swapping N tokens of KV out and in with prefilling them, then exit" },
+    { "--models",        nullptr, &options::models,      0, "NAME=PATH,...  also serve these models, routed by the \"model\" field of a request" },
+    { "--out-flush-ms",  &options::n_out_flush_ms, nullptr, 0, "N  write generated text at most N ms after it is sampled, 0 - right away (default: 20)" },
+    { "--moe-ubatch",    &options::n_moe_ubatch, nullptr, 0, "N  micro-batch size for MoE models, overrides -ub (default: 0, n_batch unless -ub is given)" },
+    { "--prompt-stream", nullptr, &options::prompt_stream, 0, "FILE  read the prompt from FILE (- for stdin) and prefill it while it arrives" },
+    { "--prompt-step",   &options::n_prompt_step, nullptr, 1, "N  tokenize a streamed prompt again after N new bytes (default: 4096)" },
+    { "--mem-budget",    &options::n_mem_budget, nullptr, 0, "MiB  size -c, -b, -ub (and -np with --serve) to fit this much RAM (default: 0, off)" },
+    { "--mem-seq-ctx",   &options::n_mem_seq_ctx, nullptr, 256, "N  context per parallel sequence --mem-budget plans for when serving (default: 4096)" },
+    { "--replay",        nullptr, &options::replay,      0, "FILE  replay the JSONL requests in FILE and compare with --replay-baseline, then exit" },
+    { "--replay-baseline", nullptr, &options::replay_baseline, 0, "FILE  expected tokens and performance, written when missing (default: <replay>.baseline)" },
+    { "--replay-tolerance", &options::n_replay_tolerance, nullptr, 0, "N  percent tokens/s may drop or peak RSS grow before the replay fails (default: 5)" },
+    { "--replay-repeat", &options::n_replay_repeat, nullptr, 1, "N  runs of all requests, the fastest one is compared (default: 3)" },
+};
+
+static bool parse_int(const char * s, int32_t & value) {
+    char * end = nullptr;
+    const long v = strtol(s, &end, 10);
+    if (end == s || *end != 0) {
+        return false;
+    }
+    value = (int32_t) v;
+    return true;
+}
+
+bool options_parse(int & argc, char ** argv, options & opts) {
+    int n = 1;
+    for (int i = 1; i < argc; i++) {
+        const option_def * opt = nullptr;
+        for (const auto & o : options_defs) {
+            if (strcmp(argv[i], o.name) == 0) {
+                opt = &o;
+                break;
+            }
+        }
+        if (!opt) {
+            opts.n_ctx_given    |= strcmp(argv[i], "-c")  == 0 || strcmp(argv[i], "--ctx-size")    == 0;
+            opts.n_ubatch_given |= strcmp(argv[i], "-ub") == 0 || strcmp(argv[i], "--ubatch-size") == 0;
+            argv[n++] = argv[i];
+            continue;
+        }
+        if (i + 1 >= argc) {
+            LOG_ERR("error: missing value for %s\n", opt->name);
+            return false;
+        }
+        const char * arg = argv[++i];
+        if (opt->s) {
+            opts.*(opt->s) = arg;
+            continue;
+        }
+        int32_t value = 0;
+        if (!parse_int(arg, value) || value < opt->min) {
+            LOG_ERR("error: invalid value for %s: '%s'\n", opt->name, arg);
+            return false;
+        }
+        opts.*(opt->i) = value;
+    }
+    // common_params_parse() also takes them from the environment
+    opts.n_ctx_given    |= getenv("LLAMA_ARG_CTX_SIZE") != nullptr;
+    opts.n_ubatch_given |= getenv("LLAMA_ARG_UBATCH")   != nullptr;
+    argc = n;
+    argv[argc] = nullptr;
+    return true;
+}
+
+void options_print_usage() {
+    LOG("\nnano-lamma options:\n");
+    for (const auto & o : options_defs) {
+        LOG("  %-14s %s\n", o.name, o.help);
+    }
+}
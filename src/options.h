@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Options of this front-end that llama.cpp's common_params_parse() does not
+// know about. They are taken out of argv before the remaining arguments are
+// handed to common_params_parse().
+
+struct options {
+    // whether -c / -ub were on the command line; they stay in argv for common_params_parse(),
+    // whose defaults cannot be told apart from explicit values afterwards
+    bool n_ctx_given    = false;
+    bool n_ubatch_given = false;
+
+    // attention-sink streaming (alternative to context shift and self-extend)
+    int32_t n_sink       = 0;  // sink tokens kept at the start of the KV cache, 0 - disabled
+    int32_t n_sink_evict = 32; // tokens evicted from the window per eviction step
+
+    // serving front-end: Unix socket path (contains '/') or loopback TCP port
+    std::string serve;
+    int32_t n_prefill_chunk = 256; // prompt tokens per decode step while other sequences are generating
+    int32_t n_choice_head   = 0;   // 1 - "choices" skip the output matmul (head.h), 0 - full logits
+
+    // offline batch generation: JSONL requests in, JSONL results out
+    std::string batch_in;
+    std::string batch_out;
+
+    // pooled embeddings: one document per input line
+    std::string embed;
+    std::string embed_out;
+    std::string embed_format = "matrix"; // matrix (embed_header + rows) or raw (rows only)
+
+    // per-token latency tracing to a Chrome trace JSON file
+    std::string trace;
+    int32_t n_trace_events = 1 << 16; // ring buffer capacity
+
+    // perplexity / KL-divergence evaluation over a text file
+    std::string ppl;
+
+    // MoE routing statistics and the mixed-precision requantization driven by them
+    std::string moe_stats;
+    std::string requant;
+    int32_t     moe_hot       = 200;    // hot expert: routing share >= moe_hot% of the uniform share
+    std::string moe_hot_type  = "q8_0"; // experts of layers whose routes mostly go to hot experts
+    std::string moe_cold_type = "q4_K"; // experts of the other layers
+
+    // in-memory snapshots of the interactive session for /undo and /retry, 0 - disabled
+    int32_t n_snapshots = 0;
+
+    // idle server sequences written to disk and read back on the next request
+    std::string kv_swap;
+    int32_t n_kv_swap_idle  = 60;   // seconds a slot stays idle before it is swapped out
+    int32_t n_kv_swap_max   = 8192; // MiB of swap files kept, the oldest are removed beyond it, 0 - no limit
+    int32_t n_kv_swap_bench = 0;    // tokens for the swap-in vs prefill benchmark, 0 - off
+
+    // further models served beside -m: NAME=PATH[,NAME=PATH...]
+    std::string models;
+
+    // generated text reaches stdout at most this many ms after it was sampled
+    int32_t n_out_flush_ms = 20;
+
+    // micro-batch size of MoE models, 0 - n_batch (or -ub when given)
+    int32_t n_moe_ubatch = 0;
+
+    // prompt read from a file or pipe ("-" - stdin) and prefilled while it arrives
+    std::string prompt_stream;
+    int32_t n_prompt_step = 4096; // bytes of new prompt text between tokenizations
+
+    // RAM budget in MiB that n_ctx, n_batch and n_parallel are sized to, 0 - off
+    int32_t n_mem_budget  = 0;
+    int32_t n_mem_seq_ctx = 4096; // context per parallel sequence when serving
+
+    // recorded requests replayed against a baseline of their tokens, throughput and peak RSS
+    std::string replay;
+    std::string replay_baseline;
+    int32_t n_replay_tolerance = 5; // percent throughput may drop or peak RSS grow
+    int32_t n_replay_repeat    = 3; // runs of all requests, the fastest counts
+};
+
+// on success argc/argv hold only the arguments left for common_params_parse()
+bool options_parse(int & argc, char ** argv, options & opts);
+
+void options_print_usage();
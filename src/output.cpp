@@ -0,0 +1,154 @@
+#include "output.h"
+
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static size_t round_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p *= 2;
+    }
+    return p;
+}
+
+output_stream::output_stream(int fd, int32_t flush_ms, size_t capacity) :
+        fd(fd), flush_ms(flush_ms), ring(round_pow2(capacity)), mask(ring.size() - 1) {
+    writer = std::thread(&output_stream::writer_loop, this);
+}
+
+output_stream::~output_stream() {
+    flush();
+    stop = true;
+    cv_writer.notify_one();
+    writer.join();
+}
+
+void output_stream::write(const char * data, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    n_produced += n;
+    if (!spilling.load(std::memory_order_acquire)) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        const size_t h = head.load(std::memory_order_acquire);
+        const size_t k = std::min(n, ring.size() - (t - h));
+        const size_t i = t & mask;
+        const size_t k0 = std::min(k, ring.size() - i);
+        memcpy(ring.data() + i, data, k0);
+        memcpy(ring.data(), data + k0, k - k0);
+        tail.store(t + k, std::memory_order_release);
+        data += k;
+        n    -= k;
+        if (n == 0) {
+            // wake the writer for the first pending byte (it then waits up to flush_ms for more)
+            // and when it falls behind
+            if (t == h || flush_ms == 0 || t + k - h >= ring.size() / 2) {
+                cv_writer.notify_one();
+            }
+            return;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(spill_mutex);
+        spill.append(data, n);
+        n_spill_bytes += n;
+        spilling.store(true, std::memory_order_release);
+    }
+    cv_writer.notify_one();
+}
+
+bool output_stream::flush(int32_t timeout_ms) {
+    const uint64_t target = n_produced;
+    if (n_written.load() >= target) {
+        return true;
+    }
+    flush_requested = true;
+    cv_writer.notify_one();
+    std::unique_lock<std::mutex> lock(mutex);
+    auto done = [&] { return n_written.load() >= target; };
+    if (timeout_ms < 0) {
+        cv_flushed.wait(lock, done);
+        return true;
+    }
+    return cv_flushed.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+}
+
+bool output_stream::write_fd(const char * a, size_t na, const char * b, size_t nb) {
+    iovec iov[2] = { { (void *) a, na }, { (void *) b, nb } };
+    int i = 0;
+    while (i < 2) {
+        if (iov[i].iov_len == 0) {
+            i++;
+            continue;
+        }
+        n_writev++;
+        ssize_t k = writev(fd, iov + i, 2 - i);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k < 0) {
+            return false;
+        }
+        for (; i < 2 && (size_t) k >= iov[i].iov_len; i++) {
+            k -= iov[i].iov_len;
+            iov[i].iov_len = 0;
+        }
+        if (i < 2) {
+            iov[i].iov_base = (char *) iov[i].iov_base + k;
+            iov[i].iov_len -= k;
+        }
+    }
+    return true;
+}
+
+void output_stream::writer_loop() {
+    std::string taken;
+    for (;;) {
+        {
+            auto pending = [&] { return tail.load() != head.load() || spilling || flush_requested || stop; };
+            auto urgent  = [&] { return tail.load() - head.load() >= ring.size() / 2 || spilling || flush_requested || stop; };
+            std::unique_lock<std::mutex> lock(mutex);
+            // a missed notification only costs one timeout
+            cv_writer.wait_for(lock, std::chrono::milliseconds(100), pending);
+            if (flush_ms > 0) {
+                cv_writer.wait_for(lock, std::chrono::milliseconds(flush_ms), urgent);
+            }
+        }
+        flush_requested = false;
+
+        // once spilling is seen the producer appends to spill only, so reading tail after it
+        // gets all of the ring that comes before the spilled text
+        const bool   spilled = spilling.load(std::memory_order_acquire);
+        const size_t h = head.load(std::memory_order_relaxed);
+        const size_t t = tail.load(std::memory_order_acquire);
+        if (t != h) {
+            const size_t i  = h & mask;
+            const size_t n0 = std::min(t - h, ring.size() - i);
+            write_fd(ring.data() + i, n0, ring.data(), t - h - n0);
+            head.store(t, std::memory_order_release);
+            n_written += t - h;
+        }
+        if (spilled) {
+            {
+                std::lock_guard<std::mutex> lock(spill_mutex);
+                taken.swap(spill);
+                spilling.store(false, std::memory_order_release);
+            }
+            write_fd(taken.data(), taken.size(), nullptr, 0);
+            n_written += taken.size();
+            taken.clear();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv_flushed.notify_all();
+        }
+        if (stop && tail.load() == head.load() && !spilling) {
+            break;
+        }
+    }
+}
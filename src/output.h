@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Asynchronous output of the generation loop (--out-flush-ms N).
+//
+// The loop appends text to a single-producer/single-consumer ring without
+// locks or system calls; a writer thread drains it with writev(), one call
+// for everything that accumulated (both halves of a wrapped ring at once).
+// The writer wakes at the latest N ms after the first pending byte, earlier
+// when the ring is half full, so text reaches the fd with bounded latency
+// while a fast loop still gets many tokens per system call. When the
+// consumer of the fd is slow and the ring fills up, further text goes to a
+// spill buffer that grows as needed instead of stalling the producer; the
+// writer takes it over with a swap. Only the writer ever blocks on the fd.
+//
+// Everything else printed to the same fd has to go through write() as well
+// or be preceded by flush(), which waits until all text so far is written.
+
+struct output_stream {
+    output_stream(int fd, int32_t flush_ms, size_t capacity = 1 << 16);
+    ~output_stream(); // flushes and stops the writer
+
+    // producer side, one thread only
+    void write(const char * data, size_t n);
+    void write(const std::string & s) { write(s.data(), s.size()); }
+
+    // waits until everything written so far reached the fd, at most timeout_ms if >= 0
+    bool flush(int32_t timeout_ms = -1);
+
+    uint64_t n_syscalls() const { return n_writev.load(); }
+    uint64_t n_spilled()  const { return n_spill_bytes; }
+
+private:
+    void writer_loop();
+    bool write_fd(const char * a, size_t na, const char * b, size_t nb);
+
+    const int     fd;
+    const int32_t flush_ms;
+
+    std::vector<char>   ring;
+    const size_t        mask;
+    std::atomic<size_t> head{0}; // read position, advanced by the writer
+    std::atomic<size_t> tail{0}; // write position, advanced by the producer
+
+    std::mutex        spill_mutex;
+    std::string       spill;
+    std::atomic<bool> spilling{false};
+    uint64_t          n_spill_bytes = 0;
+
+    uint64_t              n_produced = 0; // bytes handed to write()
+    std::atomic<uint64_t> n_written{0};   // bytes that reached the fd or were dropped on error
+    std::atomic<uint64_t> n_writev{0};
+
+    std::mutex              mutex; // only for sleeping and waking
+    std::condition_variable cv_writer;
+    std::condition_variable cv_flushed;
+    std::atomic<bool>       flush_requested{false};
+    std::atomic<bool>       stop{false};
+
+    std::thread writer;
+};
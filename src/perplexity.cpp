@@ -0,0 +1,275 @@
+#include "perplexity.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ppl_output {
+    int32_t     i_batch; // index of the logits in the current batch
+    llama_token target;  // the token that follows
+};
+
+struct ppl_result {
+    double nll     = 0.0; // -log p(target)
+    double nll_ref = 0.0; // -log p_ref(target)
+    double kld     = 0.0; // KL(p_ref || p)
+    bool   same    = false; // same most likely token as the reference
+};
+
+// log-softmax of logits into lp, returns the index of the largest logit
+static int32_t ppl_log_softmax(const float * logits, int32_t n_vocab, float * lp) {
+    int32_t i_max = 0;
+    for (int32_t i = 1; i < n_vocab; i++) {
+        if (logits[i] > logits[i_max]) {
+            i_max = i;
+        }
+    }
+    const float max = logits[i_max];
+    double sum = 0.0;
+    for (int32_t i = 0; i < n_vocab; i++) {
+        sum += expf(logits[i] - max);
+    }
+    const float log_sum = max + (float) log(sum);
+    for (int32_t i = 0; i < n_vocab; i++) {
+        lp[i] = logits[i] - log_sum;
+    }
+    return i_max;
+}
+
+// scores outputs [i0, i0 + n) on n_threads threads; rows holds one fp16 log-prob row per output
+// (read from the reference before the call for KL, written to the reference after it when saving)
+static void ppl_process(llama_context * ctx, const std::vector<ppl_output> & outs, size_t i0, size_t n,
+        int32_t n_vocab, bool save, bool kld, std::vector<ggml_fp16_t> & rows, std::vector<ppl_result> & results,
+        int n_threads) {
+    // llama_get_logits_ith() is not safe to call from several threads, the workers only read the rows
+    std::vector<const float *> logits(n);
+    for (size_t k = 0; k < n; k++) {
+        logits[k] = llama_get_logits_ith(ctx, outs[i0 + k].i_batch);
+    }
+    auto worker = [&](int ith) {
+        std::vector<float> lp (n_vocab);
+        std::vector<float> ref(kld ? n_vocab : 0);
+        for (size_t k = ith; k < n; k += n_threads) {
+            const ppl_output & o = outs[i0 + k];
+            ppl_result & r = results[k];
+            const int32_t top = ppl_log_softmax(logits[k], n_vocab, lp.data());
+            r.nll = -lp[o.target];
+            ggml_fp16_t * row = rows.data() + k * n_vocab;
+            if (save) {
+                ggml_fp32_to_fp16_row(lp.data(), row, n_vocab);
+            }
+            if (kld) {
+                ggml_fp16_to_fp32_row(row, ref.data(), n_vocab);
+                double sum = 0.0;
+                int32_t top_ref = 0;
+                for (int32_t i = 0; i < n_vocab; i++) {
+                    sum += expf(ref[i]) * (ref[i] - lp[i]);
+                    if (ref[i] > ref[top_ref]) {
+                        top_ref = i;
+                    }
+                }
+                r.kld     = std::max(0.0, sum);
+                r.nll_ref = -ref[o.target];
+                r.same    = top == top_ref;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < n_threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto & t : threads) {
+        t.join();
+    }
+}
+
+// mean and standard error of the mean
+static void ppl_mean(double sum, double sum2, size_t n, double & mean, double & err) {
+    mean = n > 0 ? sum / n : 0.0;
+    err  = n > 1 ? sqrt(std::max(0.0, sum2 / n - mean * mean) / (n - 1)) : 0.0;
+}
+
+int perplexity_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_vocab  = llama_vocab_n_tokens(vocab);
+    const int32_t n_seq    = (int32_t) llama_n_seq_max(ctx);
+    const int32_t n_ctx    = (int32_t) llama_n_ctx(ctx) / n_seq;
+    const int32_t n_batch  = (int32_t) llama_n_batch(ctx);
+    const int32_t first    = n_ctx / 2;
+    const int32_t n_scored = n_ctx - 1 - first;
+    const bool    add_bos  = llama_vocab_get_add_bos(vocab);
+    const bool    kld      = params.kl_divergence;
+    const bool    save     = !kld && !params.logits_file.empty();
+    const int     n_threads = std::max(1, params.cpuparams.n_threads);
+
+    if (kld && params.logits_file.empty()) {
+        LOG_ERR("%s: --kl-divergence needs the reference from --kl-divergence-base\n", __func__);
+        return 1;
+    }
+
+    std::ifstream in(opts.ppl);
+    if (!in) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, opts.ppl.c_str());
+        return 1;
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    const std::vector<llama_token> tokens = common_tokenize(ctx, text.str(), add_bos, false);
+
+    int32_t n_chunk = (int32_t) (tokens.size() / n_ctx);
+    if (params.n_chunks > 0) {
+        n_chunk = std::min(n_chunk, params.n_chunks);
+    }
+    if (n_chunk == 0) {
+        LOG_ERR("%s: need at least %d tokens, '%s' has %zu\n", __func__, n_ctx, opts.ppl.c_str(), tokens.size());
+        return 1;
+    }
+
+    FILE * ref = nullptr;
+    ppl_header header;
+    if (save) {
+        ref = fopen(params.logits_file.c_str(), "wb");
+        header.n_ctx    = n_ctx;
+        header.n_vocab  = n_vocab;
+        header.n_chunk  = n_chunk;
+        header.n_scored = n_scored;
+        if (!ref || fwrite(&header, sizeof(header), 1, ref) != 1 ||
+            fwrite(tokens.data(), sizeof(llama_token), (size_t) n_chunk * n_ctx, ref) != (size_t) n_chunk * n_ctx) {
+            LOG_ERR("%s: failed to write '%s'\n", __func__, params.logits_file.c_str());
+            return 1;
+        }
+    } else if (kld) {
+        ref = fopen(params.logits_file.c_str(), "rb");
+        if (!ref || fread(&header, sizeof(header), 1, ref) != 1 || memcmp(header.magic, "NPPL", 4) != 0) {
+            LOG_ERR("%s: '%s' is not a reference log-prob file\n", __func__, params.logits_file.c_str());
+            return 1;
+        }
+        if ((int32_t) header.n_ctx != n_ctx || (int32_t) header.n_vocab != n_vocab || (int32_t) header.n_scored != n_scored) {
+            LOG_ERR("%s: reference was made with n_ctx = %u, n_vocab = %u (now %d, %d)\n", __func__,
+                    header.n_ctx, header.n_vocab, n_ctx, n_vocab);
+            return 1;
+        }
+        std::vector<llama_token> ref_tokens((size_t) header.n_chunk * n_ctx);
+        if (fread(ref_tokens.data(), sizeof(llama_token), ref_tokens.size(), ref) != ref_tokens.size()) {
+            LOG_ERR("%s: '%s' is truncated\n", __func__, params.logits_file.c_str());
+            return 1;
+        }
+        n_chunk = std::min(n_chunk, (int32_t) header.n_chunk);
+        if (!std::equal(ref_tokens.begin(), ref_tokens.begin() + (size_t) n_chunk * n_ctx, tokens.begin())) {
+            LOG_ERR("%s: the reference was made for a different text or tokenizer\n", __func__);
+            return 1;
+        }
+    }
+
+    LOG_INF("%s: %zu tokens, %d chunks of %d tokens, %d chunks per batch, scoring %d tokens per chunk%s\n", __func__,
+            tokens.size(), n_chunk, n_ctx, n_seq, n_scored, save ? ", saving reference" : kld ? ", comparing with reference" : "");
+
+    // a few tokens at a time through the fp16 row buffer
+    const size_t n_group = (size_t) n_threads * 4;
+    std::vector<ggml_fp16_t> rows(n_group * n_vocab);
+    std::vector<ppl_result>  results(n_group);
+
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    std::vector<ppl_output> outs;
+
+    double  nll = 0.0, nll2 = 0.0, nll_ref = 0.0, nll_ref2 = 0.0, kl = 0.0, kl2 = 0.0, kl_max = 0.0;
+    size_t  n_count = 0, n_same = 0;
+    bool    ok = true;
+
+    const int64_t t_start = ggml_time_us();
+
+    auto flush = [&]() {
+        if (batch.n_tokens == 0) {
+            return;
+        }
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_ERR("%s: llama_decode() failed\n", __func__);
+            ok = false;
+            return;
+        }
+        for (size_t i0 = 0; i0 < outs.size() && ok; i0 += n_group) {
+            const size_t n = std::min(n_group, outs.size() - i0);
+            if (kld && fread(rows.data(), sizeof(ggml_fp16_t), n * n_vocab, ref) != n * n_vocab) {
+                LOG_ERR("%s: '%s' is truncated\n", __func__, params.logits_file.c_str());
+                ok = false;
+                break;
+            }
+            ppl_process(ctx, outs, i0, n, n_vocab, save, kld, rows, results, n_threads);
+            if (save && fwrite(rows.data(), sizeof(ggml_fp16_t), n * n_vocab, ref) != n * n_vocab) {
+                LOG_ERR("%s: failed to write '%s'\n", __func__, params.logits_file.c_str());
+                ok = false;
+                break;
+            }
+            for (size_t k = 0; k < n; k++) {
+                const ppl_result & r = results[k];
+                nll      += r.nll;
+                nll2     += r.nll * r.nll;
+                nll_ref  += r.nll_ref;
+                nll_ref2 += r.nll_ref * r.nll_ref;
+                kl       += r.kld;
+                kl2      += r.kld * r.kld;
+                kl_max    = std::max(kl_max, r.kld);
+                n_same   += r.same;
+            }
+            n_count += n;
+        }
+        common_batch_clear(batch);
+        outs.clear();
+    };
+
+    for (int32_t c0 = 0; c0 < n_chunk && ok; c0 += n_seq) {
+        const int32_t n_cur = std::min(n_seq, n_chunk - c0);
+        llama_kv_cache_clear(ctx);
+        for (int32_t s = 0; s < n_cur && ok; s++) {
+            const llama_token * chunk = tokens.data() + (size_t) (c0 + s) * n_ctx;
+            for (int32_t j = 0; j < n_ctx && ok; j++) {
+                const bool output = j >= first && j < n_ctx - 1;
+                if (output) {
+                    outs.push_back({ batch.n_tokens, chunk[j + 1] });
+                }
+                // every chunk starts with BOS as if it was a document of its own
+                common_batch_add(batch, j == 0 && add_bos ? llama_vocab_bos(vocab) : chunk[j], j, { s }, output);
+                if (batch.n_tokens == n_batch) {
+                    flush();
+                }
+            }
+        }
+        flush();
+        if (ok) {
+            LOG("[%d]%.4f,", c0 + n_cur, exp(nll / n_count));
+        }
+    }
+    LOG("\n");
+    llama_batch_free(batch);
+    if (ref) {
+        ok = fclose(ref) == 0 && ok;
+    }
+    if (!ok) {
+        return 1;
+    }
+
+    const double t_s = (ggml_time_us() - t_start) / 1e6;
+    double mean, err;
+    ppl_mean(nll, nll2, n_count, mean, err);
+    LOG_INF("%s: %zu tokens scored in %.2f s (%.1f tokens/s evaluated)\n", __func__, n_count, t_s,
+            t_s > 0 ? (double) n_chunk * n_ctx / t_s : 0.0);
+    LOG_INF("%s: perplexity = %.4f +/- %.4f\n", __func__, exp(mean), exp(mean) * err);
+    if (kld) {
+        double mean_ref, err_ref, mean_kl, err_kl;
+        ppl_mean(nll_ref, nll_ref2, n_count, mean_ref, err_ref);
+        ppl_mean(kl, kl2, n_count, mean_kl, err_kl);
+        LOG_INF("%s: reference perplexity = %.4f, ln(PPL / PPL_ref) = %.6f\n", __func__, exp(mean_ref), mean - mean_ref);
+        LOG_INF("%s: KL divergence = %.6f +/- %.6f, max = %.6f\n", __func__, mean_kl, err_kl, kl_max);
+        LOG_INF("%s: same top token = %.3f %%\n", __func__, 100.0 * n_same / std::max<size_t>(1, n_count));
+    }
+    return 0;
+}
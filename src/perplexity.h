@@ -0,0 +1,34 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+
+#include <cstdint>
+
+// Perplexity and KL-divergence evaluation (--ppl FILE).
+//
+// The tokenized text is cut into chunks of -c tokens (512 when -c is not
+// given); the second half of every chunk is scored with the first half as
+// context. n_batch / chunk length chunks are evaluated at once as separate
+// sequences of one llama_decode(), and the context holds all of them.
+//
+//   --ppl FILE                                       perplexity
+//   --ppl FILE --kl-divergence-base REF              also store reference log-probs in REF
+//   --ppl FILE --kl-divergence-base REF --kl-divergence
+//                                                    compare against REF: KL divergence,
+//                                                    top-token agreement, perplexity delta
+//
+// Log-probs are streamed to and from REF a few tokens at a time, so memory
+// does not grow with the length of the text.
+
+struct ppl_header {
+    char     magic[4] = { 'N', 'P', 'P', 'L' };
+    uint32_t version  = 1;
+    uint32_t n_ctx    = 0; // tokens per chunk
+    uint32_t n_vocab  = 0;
+    uint32_t n_chunk  = 0;
+    uint32_t n_scored = 0; // scored tokens per chunk
+    // followed by n_chunk * n_ctx tokens (int32), then n_chunk * n_scored rows of n_vocab log-probs (fp16)
+};
+
+int perplexity_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx);
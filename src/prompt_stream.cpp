@@ -0,0 +1,143 @@
+#include "prompt_stream.h"
+
+#include "log.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+prompt_stream::prompt_stream(const llama_vocab * vocab, size_t step) : vocab(vocab), step(std::max<size_t>(step, 1)) {}
+
+bool prompt_stream::stable(std::vector<llama_token> & tokens) {
+    if (buf.size() < n_tokenized + std::max(step, n_tokenized / 8)) {
+        return false;
+    }
+    // the word after the last whitespace run may still grow, and with it the tokens of the run
+    size_t cut = buf.find_last_of(" \t\r\n");
+    if (cut == std::string::npos) {
+        return false;
+    }
+    while (cut > 0 && strchr(" \t\r\n", buf[cut - 1])) {
+        cut--;
+    }
+    n_tokenized = buf.size();
+    tokens = common_tokenize(vocab, buf.substr(0, cut), true, true);
+    if (!tokens.empty()) {
+        tokens.pop_back();
+    }
+    return true;
+}
+
+std::vector<llama_token> prompt_stream::finish() const {
+    return common_tokenize(vocab, buf, true, true);
+}
+
+size_t prompt_common_prefix(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// brings sequence 0 from decoded to tokens, dropping what no longer matches
+static bool prompt_prefill(llama_context * ctx, std::vector<llama_token> & tokens, int32_t n_batch,
+        std::vector<llama_token> & decoded, int32_t & n_rollback) {
+    const size_t n_same = prompt_common_prefix(decoded, tokens);
+    if (n_same < decoded.size()) {
+        LOG_DBG("%s: tokens from %zu changed, %zu dropped\n", __func__, n_same, decoded.size() - n_same);
+        llama_kv_cache_seq_rm(ctx, 0, (llama_pos) n_same, -1);
+        decoded.resize(n_same);
+        n_rollback++;
+    }
+    for (size_t i = decoded.size(); i < tokens.size(); i += n_batch) {
+        const int32_t n_eval = (int32_t) std::min(tokens.size() - i, (size_t) n_batch);
+        TRACE_SCOPE("decode", n_eval);
+        trace_decode_begin();
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i, n_eval))) {
+            LOG_ERR("%s: failed to eval\n", __func__);
+            return false;
+        }
+        decoded.insert(decoded.end(), tokens.begin() + i, tokens.begin() + i + n_eval);
+    }
+    return true;
+}
+
+bool prompt_stream_prefill(llama_context * ctx, const std::string & path, size_t step, int32_t n_batch,
+        std::string & text, std::vector<llama_token> & decoded) {
+    const int fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG_ERR("%s: failed to open '%s': %s\n", __func__, path.c_str(), strerror(errno));
+        return false;
+    }
+    prompt_stream stream(llama_model_get_vocab(llama_get_model(ctx)), step);
+    const size_t n_max = llama_n_ctx(ctx) - 4;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::string             incoming;
+    bool                    eof    = false;
+    int                     err    = 0;
+
+    // the writer of fd is never held up by a decode
+    std::thread reader([&]() {
+        char tmp[1 << 16];
+        for (;;) {
+            const ssize_t k = read(fd, tmp, sizeof(tmp));
+            if (k < 0 && errno == EINTR) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (k <= 0) {
+                    eof = true;
+                    err = k < 0 ? errno : 0;
+                } else {
+                    incoming.append(tmp, (size_t) k);
+                }
+            }
+            cv.notify_one();
+            if (k <= 0) {
+                break;
+            }
+        }
+    });
+
+    const int64_t t_start = ggml_time_us();
+    int32_t n_rollback = 0;
+    bool ok = true;
+    std::vector<llama_token> tokens;
+    for (bool done = false; !done; ) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return !incoming.empty() || eof; });
+            stream.append(incoming);
+            incoming.clear();
+            done = eof;
+        }
+        // the rest is decoded by the caller once the whole prompt is tokenized
+        if (done || !ok || !stream.stable(tokens) || tokens.size() > n_max) {
+            continue;
+        }
+        ok = prompt_prefill(ctx, tokens, n_batch, decoded, n_rollback);
+    }
+    reader.join();
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+
+    text = stream.text();
+    if (err != 0) {
+        LOG_ERR("%s: failed to read the prompt: %s\n", __func__, strerror(err));
+    }
+    LOG_INF("%s: %zu bytes read, %zu tokens prefilled meanwhile in %.1f ms, %d rollbacks\n", __func__,
+            text.size(), decoded.size(), (ggml_time_us() - t_start) / 1e3, n_rollback);
+    return ok && err == 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Prompt text that is tokenized and prefilled while it is still arriving
+// (--prompt-stream FILE, or a text/plain body sent to the server).
+//
+// Appending text only changes the tokens near its end: pre-tokenizers split
+// at whitespace and punctuation and nothing merges across those splits. So
+// the text up to the start of its last whitespace run is tokenized as it
+// arrives, minus the token right before that cut, and only the last word
+// is held back. The tokens handed out are still checked against every
+// newer tokenization, and the final one covers the complete text. A
+// tokenizer that does merge across the cut only costs re-decoding from the
+// first token that differs; the result is always exactly the tokens of
+// the whole prompt.
+//
+// A tokenization is linear in the text so far, so it is only redone after
+// step bytes or an eighth of the text arrived, which keeps the total work
+// linear in the length of the prompt.
+
+struct prompt_stream {
+    prompt_stream(const llama_vocab * vocab, size_t step);
+
+    void append(const char * data, size_t n) { buf.append(data, n); }
+    void append(const std::string & s)       { buf += s; }
+
+    // tokens of the text so far that more text is not expected to change,
+    // false when too little arrived since the last call
+    bool stable(std::vector<llama_token> & tokens);
+
+    // tokens of the complete text
+    std::vector<llama_token> finish() const;
+
+    const std::string & text() const { return buf; }
+
+private:
+    const llama_vocab * vocab;
+    const size_t        step;
+
+    std::string buf;
+    size_t      n_tokenized = 0; // size of buf at the last tokenization
+};
+
+// number of leading tokens a and b have in common
+size_t prompt_common_prefix(const std::vector<llama_token> & a, const std::vector<llama_token> & b);
+
+// reads a prompt from path ("-" - stdin) until EOF on a thread of its own while the stable
+// tokens are decoded into sequence 0 of ctx; text receives the whole prompt and decoded the
+// tokens that are in the KV cache (usually all but the last few, which are left to the caller)
+bool prompt_stream_prefill(llama_context * ctx, const std::string & path, size_t step, int32_t n_batch,
+        std::string & text, std::vector<llama_token> & decoded);
@@ -0,0 +1,246 @@
+#include "replay.h"
+
+#include "batch.h"
+#include "json.hpp"
+#include "log.h"
+#include "memory.h"
+#include "prompt_stream.h"
+#include "sampling.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+struct replay_stats {
+    int64_t n_prefill = 0;
+    int64_t n_decode  = 0;
+    int64_t t_prefill = 0; // us
+    int64_t t_decode  = 0;
+
+    double prefill_tps() const { return t_prefill > 0 ? 1e6 * n_prefill / t_prefill : 0.0; }
+    double decode_tps()  const { return t_decode  > 0 ? 1e6 * n_decode  / t_decode  : 0.0; }
+};
+
+// runs one request from an empty KV cache, tokens receives what was sampled
+static bool replay_item(const common_params & params, llama_model * model, llama_context * ctx,
+        const batch_item & item, std::vector<llama_token> & tokens, replay_stats & stats) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_ctx = llama_n_ctx(ctx);
+
+    common_params_sampling sparams = params.sampling;
+    sparams.seed = item.seed;
+    common_sampler * smpl = common_sampler_init(model, sparams);
+    for (llama_token id : item.prompt) {
+        common_sampler_accept(smpl, id, false);
+    }
+    llama_kv_cache_clear(ctx);
+    tokens.clear();
+
+    bool ok = true;
+    std::vector<llama_token> prompt = item.prompt;
+    const int64_t t_start = ggml_time_us();
+    for (size_t i = 0; ok && i < prompt.size(); i += params.n_batch) {
+        const int32_t n_eval = (int32_t) std::min(prompt.size() - i, (size_t) params.n_batch);
+        ok = llama_decode(ctx, llama_batch_get_one(prompt.data() + i, n_eval)) == 0;
+    }
+    const int64_t t_prefill = ggml_time_us();
+
+    int32_t n_past = (int32_t) prompt.size();
+    int32_t n_decode = 0;
+    while (ok) {
+        llama_token id = common_sampler_sample(smpl, ctx, -1);
+        common_sampler_accept(smpl, id, true);
+        tokens.push_back(id);
+        if (llama_vocab_is_eog(vocab, id) || n_past >= n_ctx ||
+            (item.n_predict >= 0 && (int32_t) tokens.size() >= item.n_predict)) {
+            break;
+        }
+        ok = llama_decode(ctx, llama_batch_get_one(&id, 1)) == 0;
+        n_past++;
+        n_decode++;
+    }
+    const int64_t t_end = ggml_time_us();
+    common_sampler_free(smpl);
+    if (!ok) {
+        LOG_ERR("%s: llama_decode() failed for item %s\n", __func__, item.id.dump().c_str());
+        return false;
+    }
+    stats.n_prefill += (int64_t) prompt.size();
+    stats.t_prefill += t_prefill - t_start;
+    stats.n_decode  += n_decode;
+    stats.t_decode  += t_end - t_prefill;
+    return true;
+}
+
+// text of tokens from i on, for reporting where two outputs part
+static std::string replay_text(llama_context * ctx, const std::vector<llama_token> & tokens, size_t i) {
+    std::string s;
+    for (size_t j = i; j < tokens.size() && j < i + 16; j++) {
+        s += common_token_to_piece(ctx, tokens[j], true);
+    }
+    return json(s).dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+// logs a metric next to its baseline, false when it moved the wrong way by more than tol
+static bool replay_check(const char * name, double base, double now, double tol, bool higher_is_better) {
+    const double change = base > 0 ? (now - base) / base : 0.0;
+    const bool   ok     = higher_is_better ? change >= -tol : change <= tol;
+    LOG_INF("%s: %-12s baseline %10.2f, now %10.2f, %+6.1f %%%s\n", __func__, name, base, now, 100.0 * change, ok ? "" : "  FAILED");
+    return ok;
+}
+
+static bool replay_load_baseline(const std::string & path, json & baseline) {
+    std::ifstream f(path);
+    if (!f) {
+        return false;
+    }
+    try {
+        baseline = json::parse(std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>()));
+    } catch (const std::exception & e) {
+        LOG_ERR("%s: %s: %s\n", __func__, path.c_str(), e.what());
+        baseline = nullptr;
+    }
+    return true;
+}
+
+int replay_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_ctx = llama_n_ctx(ctx);
+    const std::string path = !opts.replay_baseline.empty() ? opts.replay_baseline : opts.replay + ".baseline";
+
+    common_chat_templates templates = common_chat_templates_from_model(model, params.chat_template);
+    if (!templates.template_default) {
+        LOG_ERR("%s: the model has no chat template\n", __func__);
+        return 1;
+    }
+    std::vector<batch_item> items;
+    if (!batch_load_items(opts.replay, vocab, templates, params, {}, items)) {
+        return 1;
+    }
+    for (const auto & item : items) {
+        // without one the seed is --seed, random by default, and the tokens could not be compared
+        if (!item.has_seed) {
+            LOG_ERR("%s: item %s has no \"seed\"\n", __func__, item.id.dump().c_str());
+            return 1;
+        }
+        if ((int32_t) item.prompt.size() >= n_ctx - 4) {
+            LOG_ERR("%s: prompt of item %s does not fit into n_ctx = %d\n", __func__, item.id.dump().c_str(), n_ctx);
+            return 1;
+        }
+    }
+    LOG_INF("%s: %zu items, %d runs, n_threads = %d, n_batch = %d, n_ubatch = %d\n", __func__,
+            items.size(), opts.n_replay_repeat, params.cpuparams.n_threads, params.n_batch, params.n_ubatch);
+
+    int ret = 0;
+    std::vector<std::vector<llama_token>> outputs(items.size());
+    double best_prefill = 0.0;
+    double best_decode  = 0.0;
+    for (int32_t r = 0; r < opts.n_replay_repeat; r++) {
+        replay_stats stats;
+        std::vector<llama_token> tokens;
+        for (size_t i = 0; i < items.size(); i++) {
+            if (!replay_item(params, model, ctx, items[i], tokens, stats)) {
+                return 1;
+            }
+            if (r == 0) {
+                outputs[i] = tokens;
+            } else if (tokens != outputs[i]) {
+                const size_t n = prompt_common_prefix(outputs[i], tokens);
+                LOG_ERR("%s: item %s: run %d differs from run 1 at token %zu: %s instead of %s\n", __func__,
+                        items[i].id.dump().c_str(), r + 1, n, replay_text(ctx, tokens, n).c_str(),
+                        replay_text(ctx, outputs[i], n).c_str());
+                ret = 1;
+            }
+        }
+        LOG_INF("%s: run %d: prefill %lld tokens, %.2f tokens/s, decode %lld tokens, %.2f tokens/s\n", __func__,
+                r + 1, (long long) stats.n_prefill, stats.prefill_tps(), (long long) stats.n_decode, stats.decode_tps());
+        best_prefill = std::max(best_prefill, stats.prefill_tps());
+        best_decode  = std::max(best_decode,  stats.decode_tps());
+    }
+    const size_t rss_peak = mem_rss_peak();
+
+    json baseline;
+    if (!replay_load_baseline(path, baseline)) {
+        if (ret != 0) {
+            LOG_ERR("%s: the runs differ, no baseline written\n", __func__);
+            return ret;
+        }
+        json recorded = json::array();
+        for (size_t i = 0; i < items.size(); i++) {
+            recorded.push_back({{"id", items[i].id}, {"tokens", outputs[i]}});
+        }
+        const json b = {
+            {"model",       params.model},
+            {"n_threads",   params.cpuparams.n_threads},
+            {"n_batch",     params.n_batch},
+            {"n_ubatch",    params.n_ubatch},
+            {"prefill_tps", best_prefill},
+            {"decode_tps",  best_decode},
+            {"rss_peak",    rss_peak},
+            {"items",       recorded},
+        };
+        std::ofstream f(path);
+        f << b.dump(1) << "\n";
+        if (!f) {
+            LOG_ERR("%s: failed to write '%s'\n", __func__, path.c_str());
+            return 1;
+        }
+        LOG_INF("%s: baseline written to '%s': prefill %.2f tokens/s, decode %.2f tokens/s, peak RSS %.1f MiB\n", __func__,
+                path.c_str(), best_prefill, best_decode, rss_peak / (1024.0 * 1024.0));
+        return 0;
+    }
+    if (baseline.is_null()) {
+        return 1;
+    }
+
+    try {
+        const std::pair<const char *, int32_t> settings[] = {
+            { "n_threads", params.cpuparams.n_threads },
+            { "n_batch",   params.n_batch },
+            { "n_ubatch",  params.n_ubatch },
+        };
+        for (const auto & [key, now] : settings) {
+            if (baseline.at(key).get<int32_t>() != now) {
+                LOG_WRN("%s: %s = %d, the baseline was taken with %d\n", __func__, key, now, baseline.at(key).get<int32_t>());
+            }
+        }
+        std::map<std::string, std::vector<llama_token>> expected;
+        for (const auto & b : baseline.at("items")) {
+            expected[b.at("id").dump()] = b.at("tokens").get<std::vector<llama_token>>();
+        }
+        for (size_t i = 0; i < items.size(); i++) {
+            const std::string id = items[i].id.dump();
+            const auto it = expected.find(id);
+            if (it == expected.end()) {
+                LOG_ERR("%s: item %s is not in the baseline\n", __func__, id.c_str());
+                ret = 1;
+            } else if (it->second != outputs[i]) {
+                const size_t n = prompt_common_prefix(it->second, outputs[i]);
+                LOG_ERR("%s: item %s differs from the baseline at token %zu: %s instead of %s\n", __func__,
+                        id.c_str(), n, replay_text(ctx, outputs[i], n).c_str(), replay_text(ctx, it->second, n).c_str());
+                ret = 1;
+            }
+        }
+
+        const double tol = opts.n_replay_tolerance / 100.0;
+        const double MiB = 1024.0 * 1024.0;
+        bool ok = true;
+        ok &= replay_check("prefill t/s",  baseline.at("prefill_tps").get<double>(),     best_prefill,   tol, true);
+        ok &= replay_check("decode t/s",   baseline.at("decode_tps").get<double>(),      best_decode,    tol, true);
+        ok &= replay_check("peak RSS MiB", baseline.at("rss_peak").get<double>() / MiB, rss_peak / MiB, tol, false);
+        if (!ok) {
+            ret = 1;
+        }
+    } catch (const std::exception & e) {
+        LOG_ERR("%s: %s: %s\n", __func__, path.c_str(), e.what());
+        return 1;
+    }
+    LOG_INF("%s: %s\n", __func__, ret == 0 ? "passed" : "FAILED");
+    return ret;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+
+// Deterministic replay and performance regression gate (--replay FILE).
+//
+// FILE holds recorded requests in the JSONL format of --batch-in, each with
+// its own "seed"; a request without one is refused, as --seed would make it
+// random. Every request runs alone from an empty KV cache: the
+// prompt is prefilled -b tokens at a time, then up to "n_predict" tokens are
+// sampled one by one. All requests are run --replay-repeat times; the tokens
+// of every run must be the same, and the fastest prefill and decode
+// throughput count, which keeps a noisy machine from failing the gate.
+//
+// The first replay writes the baseline (--replay-baseline, default
+// <FILE>.baseline): the tokens of every request, prefill and decode
+// tokens/s, peak RSS and the settings they depend on. Later replays fail,
+// with exit status 1, when a token differs, or when a throughput drops or
+// the peak RSS grows by more than --replay-tolerance percent. A baseline
+// is accepted again by deleting the file; throughput is only comparable
+// on the same machine with the same -t, -b and -ub.
+
+int replay_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx);
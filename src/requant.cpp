@@ -0,0 +1,331 @@
+#include "requant.h"
+
+#include "ggml-backend.h"
+#include "gguf.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// statistics of one merged expert tensor, accumulated over all its MUL_MAT_ID evaluations
+struct moe_stats_entry {
+    int32_t n_expert = 0;
+    int32_t n_col    = 0;
+    std::vector<int64_t> counts; // rows routed to each expert
+    std::vector<float>   values; // sum of squared inputs, n_col per expert
+};
+
+typedef std::map<std::string, moe_stats_entry> moe_stats_map;
+
+static std::mutex    g_moe_mutex;
+static moe_stats_map g_moe_stats;
+static std::string   g_moe_path;
+static std::vector<uint8_t> g_moe_buf; // host copies of tensors that live in device buffers
+static ggml_backend_sched_eval_callback g_moe_next = nullptr;
+
+static const char moe_stats_magic[4] = { 'M', 'O', 'E', 'S' };
+
+static bool moe_stats_load(const std::string & path, moe_stats_map & stats) {
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    char     magic[4] = {};
+    uint32_t version = 0, n_entries = 0;
+    bool ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, moe_stats_magic, 4) == 0 &&
+              fread(&version, sizeof(version), 1, f) == 1 && version == 1 &&
+              fread(&n_entries, sizeof(n_entries), 1, f) == 1;
+    for (uint32_t i = 0; ok && i < n_entries; i++) {
+        uint32_t n_name = 0;
+        ok = fread(&n_name, sizeof(n_name), 1, f) == 1 && n_name < 1024;
+        std::string name(ok ? n_name : 0, '\0');
+        moe_stats_entry e;
+        ok = ok && fread(name.data(), 1, n_name, f) == n_name &&
+             fread(&e.n_expert, sizeof(e.n_expert), 1, f) == 1 &&
+             fread(&e.n_col, sizeof(e.n_col), 1, f) == 1 && e.n_expert > 0 && e.n_col > 0;
+        if (ok) {
+            e.counts.resize(e.n_expert);
+            e.values.resize((size_t) e.n_expert * e.n_col);
+            ok = fread(e.counts.data(), sizeof(int64_t), e.counts.size(), f) == e.counts.size() &&
+                 fread(e.values.data(), sizeof(float), e.values.size(), f) == e.values.size();
+        }
+        if (ok) {
+            stats[name] = std::move(e);
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        LOG_ERR("%s: '%s' is not a valid MoE statistics file\n", __func__, path.c_str());
+    }
+    return ok;
+}
+
+void moe_stats_init(const std::string & path, ggml_backend_sched_eval_callback next) {
+    g_moe_path = path;
+    g_moe_next = next;
+    FILE * f = fopen(path.c_str(), "rb");
+    if (f) {
+        fclose(f);
+        // keep adding to what earlier runs collected
+        if (moe_stats_load(path, g_moe_stats)) {
+            LOG_INF("%s: continuing %zu expert tensors from '%s'\n", __func__, g_moe_stats.size(), path.c_str());
+        } else {
+            g_moe_stats.clear();
+        }
+    }
+}
+
+bool moe_stats_write() {
+    std::lock_guard<std::mutex> lock(g_moe_mutex);
+    if (g_moe_path.empty() || g_moe_stats.empty()) {
+        return true;
+    }
+    FILE * f = fopen(g_moe_path.c_str(), "wb");
+    if (!f) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, g_moe_path.c_str());
+        return false;
+    }
+    const uint32_t version = 1, n_entries = (uint32_t) g_moe_stats.size();
+    bool ok = fwrite(moe_stats_magic, 1, 4, f) == 4 &&
+              fwrite(&version, sizeof(version), 1, f) == 1 &&
+              fwrite(&n_entries, sizeof(n_entries), 1, f) == 1;
+    for (const auto & [name, e] : g_moe_stats) {
+        const uint32_t n_name = (uint32_t) name.size();
+        ok = ok && fwrite(&n_name, sizeof(n_name), 1, f) == 1 && fwrite(name.data(), 1, n_name, f) == n_name &&
+             fwrite(&e.n_expert, sizeof(e.n_expert), 1, f) == 1 && fwrite(&e.n_col, sizeof(e.n_col), 1, f) == 1 &&
+             fwrite(e.counts.data(), sizeof(int64_t), e.counts.size(), f) == e.counts.size() &&
+             fwrite(e.values.data(), sizeof(float), e.values.size(), f) == e.values.size();
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        LOG_ERR("%s: failed to write '%s'\n", __func__, g_moe_path.c_str());
+    }
+    return ok;
+}
+
+// pointer to the tensor data in host memory, copied into buf when the tensor lives elsewhere
+static const uint8_t * moe_host_data(const ggml_tensor * t, std::vector<uint8_t> & buf) {
+    if (!t->buffer || ggml_backend_buffer_is_host(t->buffer)) {
+        return (const uint8_t *) t->data;
+    }
+    buf.resize(ggml_nbytes(t));
+    ggml_backend_tensor_get(t, buf.data(), 0, buf.size());
+    return buf.data();
+}
+
+bool moe_stats_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    const bool moe = t->op == GGML_OP_MUL_MAT_ID;
+    if (!moe) {
+        return g_moe_next ? g_moe_next(t, ask, user_data) : !ask;
+    }
+    if (ask) {
+        return true;
+    }
+    const ggml_tensor * w   = t->src[0]; // [n_col, n_row, n_expert]
+    const ggml_tensor * x   = t->src[1]; // [n_col, n_used or 1, n_tokens]
+    const ggml_tensor * ids = t->src[2]; // [n_used, n_tokens]
+    if (x->type == GGML_TYPE_F32 && ids->type == GGML_TYPE_I32 && x->ne[0] == w->ne[0]) {
+        std::lock_guard<std::mutex> lock(g_moe_mutex);
+        std::vector<uint8_t> ids_buf;
+        const uint8_t * ids_data = moe_host_data(ids, ids_buf);
+        const uint8_t * x_data   = moe_host_data(x, g_moe_buf);
+        moe_stats_entry & e = g_moe_stats[w->name];
+        if (e.counts.empty()) {
+            e.n_expert = (int32_t) w->ne[2];
+            e.n_col    = (int32_t) w->ne[0];
+            e.counts.assign(e.n_expert, 0);
+            e.values.assign((size_t) e.n_expert * e.n_col, 0.0f);
+        }
+        for (int64_t i = 0; i < ids->ne[1]; i++) {
+            const int32_t * experts = (const int32_t *) (ids_data + i * ids->nb[1]);
+            for (int64_t k = 0; k < ids->ne[0]; k++) {
+                const int32_t ex = experts[k];
+                if (ex < 0 || ex >= e.n_expert) {
+                    continue;
+                }
+                const float * row = (const float *) (x_data + (k % x->ne[1]) * x->nb[1] + i * x->nb[2]);
+                float * sum = e.values.data() + (size_t) ex * e.n_col;
+                for (int32_t j = 0; j < e.n_col; j++) {
+                    sum[j] += row[j] * row[j];
+                }
+                e.counts[ex]++;
+            }
+        }
+    }
+    // the next callback only sees the tensors it asked for itself; false from it would stop the split
+    if (g_moe_next && g_moe_next(t, true, user_data)) {
+        g_moe_next(t, false, user_data);
+    }
+    return true;
+}
+
+static bool requant_same_name(const char * a, const std::string & b) {
+    return strlen(a) == b.size() && std::equal(b.begin(), b.end(), a, [](char x, char y) {
+        return tolower((unsigned char) x) == tolower((unsigned char) y);
+    });
+}
+
+static bool requant_parse_type(const std::string & name, ggml_type & type) {
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const ggml_type_traits * traits = ggml_get_type_traits((ggml_type) i);
+        const char * s = ggml_type_name((ggml_type) i);
+        if (!s || !traits->to_float || traits->blck_size == 0) {
+            continue;
+        }
+        if (requant_same_name(s, name) && (traits->is_quantized || i == GGML_TYPE_F16 || i == GGML_TYPE_BF16)) {
+            type = (ggml_type) i;
+            return true;
+        }
+    }
+    LOG_ERR("%s: unknown or unsupported tensor type '%s'\n", __func__, name.c_str());
+    return false;
+}
+
+// requantizes every expert of a merged [n_col, n_row, n_expert] tensor against its own importance matrix
+static void requant_experts(const ggml_tensor * t, const moe_stats_entry & e, ggml_type type,
+        std::vector<uint8_t> & out, int n_threads) {
+    const int64_t n_col = t->ne[0], n_row = t->ne[1], n_expert = t->ne[2];
+    const size_t  size  = ggml_row_size(type, n_col) * n_row;
+    const ggml_to_float_t to_float = ggml_get_type_traits(t->type)->to_float;
+    out.resize(size * n_expert);
+    auto worker = [&](int ith) {
+        std::vector<float> f32(n_col * n_row);
+        std::vector<float> imatrix(n_col);
+        for (int64_t ex = ith; ex < n_expert; ex += n_threads) {
+            const uint8_t * src = (const uint8_t *) t->data + ex * t->nb[2];
+            for (int64_t r = 0; r < n_row; r++) {
+                to_float(src + r * t->nb[1], f32.data() + r * n_col, n_col);
+            }
+            const float * im = nullptr;
+            if (e.counts[ex] > 0) {
+                for (int64_t j = 0; j < n_col; j++) {
+                    imatrix[j] = e.values[ex * n_col + j] / e.counts[ex];
+                }
+                im = imatrix.data();
+            } else if (ggml_quantize_requires_imatrix(type)) {
+                std::fill(imatrix.begin(), imatrix.end(), 1.0f); // never routed: nothing to weigh by
+                im = imatrix.data();
+            }
+            ggml_quantize_chunk(type, f32.data(), out.data() + ex * size, 0, n_row, n_col, im);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min<int64_t>(n_threads, n_expert); i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto & th : threads) {
+        th.join();
+    }
+}
+
+int requant_run(const common_params & params, const options & opts) {
+    moe_stats_map stats;
+    if (opts.moe_stats.empty() || !moe_stats_load(opts.moe_stats, stats) || stats.empty()) {
+        LOG_ERR("%s: --requant needs routing statistics from a run with --moe-stats FILE\n", __func__);
+        return 1;
+    }
+    ggml_type hot, cold;
+    if (!requant_parse_type(opts.moe_hot_type, hot) || !requant_parse_type(opts.moe_cold_type, cold)) {
+        return 1;
+    }
+    const int n_threads = std::max(1, params.cpuparams.n_threads);
+
+    ggml_context * ctx_data = nullptr;
+    gguf_init_params ip = { /*.no_alloc =*/ false, /*.ctx =*/ &ctx_data };
+    gguf_context * src = gguf_init_from_file(params.model.c_str(), ip);
+    if (!src) {
+        LOG_ERR("%s: failed to read '%s'\n", __func__, params.model.c_str());
+        return 1;
+    }
+    gguf_context * dst = gguf_init_empty();
+    gguf_set_kv(dst, src);
+
+    const int64_t n_tensors = gguf_get_n_tensors(src);
+    std::vector<std::vector<uint8_t>> data(n_tensors); // requantized tensors until written
+    size_t size_src = 0, size_dst = 0, n_hot = 0, n_cold = 0;
+
+    for (int64_t i = 0; i < n_tensors; i++) {
+        const char  * name = gguf_get_tensor_name(src, i);
+        ggml_tensor * t    = ggml_get_tensor(ctx_data, name);
+        gguf_add_tensor(dst, t);
+        size_src += ggml_nbytes(t);
+
+        const auto it = stats.find(name);
+        if (it == stats.end() || it->second.n_expert != t->ne[2] || it->second.n_col != t->ne[0]) {
+            gguf_set_tensor_data(dst, name, t->data);
+            size_dst += ggml_nbytes(t);
+            continue;
+        }
+        const moe_stats_entry & e = it->second;
+        int64_t total = 0, routes_hot = 0;
+        int32_t experts_hot = 0;
+        for (int64_t c : e.counts) {
+            total += c;
+        }
+        for (int64_t c : e.counts) {
+            if (c * e.n_expert * 100 >= (int64_t) opts.moe_hot * total) {
+                routes_hot += c;
+                experts_hot++;
+            }
+        }
+        // the type most of this tensor's routed rows would have asked for
+        const bool layer_hot = 2 * routes_hot > total;
+        ggml_type type = layer_hot ? hot : cold;
+        if (t->ne[0] % ggml_blck_size(type) != 0) {
+            LOG_WRN("%s: %s: %lld columns do not fit %s blocks, kept as %s\n", __func__, name,
+                    (long long) t->ne[0], ggml_type_name(type), ggml_type_name(t->type));
+            type = t->type;
+        }
+        LOG_INF("%s: %-28s %2d/%d hot experts take %5.1f%% of %lld routes -> %s\n", __func__, name,
+                experts_hot, e.n_expert, total > 0 ? 100.0 * routes_hot / total : 0.0, (long long) total, ggml_type_name(type));
+        (layer_hot ? n_hot : n_cold)++;
+        if (type == t->type) {
+            gguf_set_tensor_data(dst, name, t->data);
+            size_dst += ggml_nbytes(t);
+            continue;
+        }
+        requant_experts(t, e, type, data[i], n_threads);
+        gguf_set_tensor_type(dst, name, type);
+        gguf_set_tensor_data(dst, name, data[i].data());
+        size_dst += data[i].size();
+    }
+
+    LOG_INF("%s: writing '%s'\n", __func__, opts.requant.c_str());
+    const bool ok = gguf_write_to_file(dst, opts.requant.c_str(), false);
+    gguf_free(dst);
+    gguf_free(src);
+    ggml_free(ctx_data);
+    if (!ok) {
+        LOG_ERR("%s: failed to write '%s'\n", __func__, opts.requant.c_str());
+        return 1;
+    }
+    LOG_INF("%s: %zu expert tensors at %s, %zu at %s, %.1f MiB -> %.1f MiB\n", __func__,
+            n_hot, ggml_type_name(hot), n_cold, ggml_type_name(cold), size_src / 1048576.0, size_dst / 1048576.0);
+    return 0;
+}
+
+int32_t moe_expert_count(const std::string & path) {
+    gguf_init_params ip = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * g = gguf_init_from_file(path.c_str(), ip);
+    if (!g) {
+        return 0;
+    }
+    int32_t n_expert = 0;
+    const int64_t i_arch = gguf_find_key(g, "general.architecture");
+    if (i_arch >= 0) {
+        const int64_t i = gguf_find_key(g, (std::string(gguf_get_val_str(g, i_arch)) + ".expert_count").c_str());
+        if (i >= 0) {
+            n_expert = (int32_t) gguf_get_val_u32(g, i);
+        }
+    }
+    gguf_free(g);
+    return n_expert;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+
+#include <cstdint>
+
+// Mixed-precision requantization of MoE experts from routing statistics.
+//
+//   --moe-stats FILE                    record expert routing and per-expert
+//                                       input activations of any run (--ppl,
+//                                       --batch-in, --serve, interactive) and
+//                                       add them to FILE at exit
+//   --requant OUT --moe-stats FILE      write a copy of -m with the expert
+//                                       tensors requantized, then exit
+//
+// GGUF stores the experts of a layer as one merged [n_embd, n_ff, n_expert]
+// tensor and a tensor has a single type, so precision is chosen per layer:
+// an expert is hot when it takes at least --moe-hot percent of the uniform
+// routing share, and a layer keeps --moe-hot-type when its hot experts carry
+// the majority of its routes, otherwise it drops to --moe-cold-type. Within
+// a tensor every expert is quantized against its own activation statistics
+// (importance matrix), so rarely used experts still get a usable fit.
+// Attention, embeddings, router and norms are copied unchanged.
+//
+// scripts/requant.sh checks the result against the source with --ppl and
+// --kl-divergence.
+
+// eval callback for common_params::cb_eval, chains to next (if any) for other tensors
+bool moe_stats_eval_callback(struct ggml_tensor * t, bool ask, void * user_data);
+void moe_stats_init(const std::string & path, ggml_backend_sched_eval_callback next);
+bool moe_stats_write();
+
+int requant_run(const common_params & params, const options & opts);
+
+// experts per MoE layer from the GGUF metadata of path, 0 for dense models or unreadable files
+int32_t moe_expert_count(const std::string & path);
@@ -0,0 +1,86 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <numeric>
+
+static const char * sched_class_names[SCHED_CLASS_COUNT] = { "interactive", "normal", "batch" };
+
+const char * sched_class_name(sched_class cls) {
+    return sched_class_names[cls];
+}
+
+bool sched_class_from_name(const std::string & name, sched_class & cls) {
+    for (int i = 0; i < SCHED_CLASS_COUNT; i++) {
+        if (name == sched_class_names[i]) {
+            cls = (sched_class) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool sched_before(const sched_entry & a, const sched_entry & b) {
+    if (a.cls != b.cls) {
+        return a.cls < b.cls;
+    }
+    if (a.t_deadline != b.t_deadline) {
+        // entries with a deadline go first, earliest deadline first
+        if (a.t_deadline == 0 || b.t_deadline == 0) {
+            return b.t_deadline == 0;
+        }
+        return a.t_deadline < b.t_deadline;
+    }
+    if (a.t_arrival != b.t_arrival) {
+        return a.t_arrival < b.t_arrival;
+    }
+    return a.id < b.id;
+}
+
+std::vector<int32_t> sched_plan(const std::vector<sched_job> & jobs, int32_t n_batch, int32_t n_prefill_chunk) {
+    std::vector<int32_t> n_tokens(jobs.size(), 0);
+    std::vector<size_t>  order(jobs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&jobs](size_t a, size_t b) {
+        return sched_before(jobs[a].entry, jobs[b].entry);
+    });
+
+    int32_t n_used = 0;
+    bool    any_decoding = false;
+    for (size_t i : order) {
+        if (jobs[i].decoding && jobs[i].n_pending > 0 && n_used < n_batch) {
+            n_tokens[i] = std::min(jobs[i].n_pending, n_batch - n_used);
+            n_used += n_tokens[i];
+            any_decoding = true;
+        }
+    }
+
+    // with nobody waiting for their next token prefill may take the whole batch
+    int32_t n_budget = n_batch - n_used;
+    if (any_decoding) {
+        n_budget = std::min(n_budget, n_prefill_chunk);
+    }
+    for (size_t i : order) {
+        if (!jobs[i].decoding && jobs[i].n_pending > 0 && n_budget > 0) {
+            n_tokens[i] = std::min(jobs[i].n_pending, n_budget);
+            n_budget -= n_tokens[i];
+        }
+    }
+    return n_tokens;
+}
+
+void sched_stats::queued(const sched_entry & e) {
+    n_queued[e.cls]++;
+}
+
+void sched_stats::started(const sched_entry & e, int64_t t_now) {
+    const int64_t t = t_now - e.t_arrival;
+    n_queued  [e.cls]--;
+    n_started [e.cls]++;
+    t_wait    [e.cls] += t;
+    t_wait_max[e.cls]  = std::max(t_wait_max[e.cls], t);
+}
+
+void sched_stats::expired(const sched_entry & e) {
+    n_queued [e.cls]--;
+    n_expired[e.cls]++;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Request scheduling policy of the serving front-end.
+//
+// Queued requests are admitted by class, then earliest deadline, then
+// arrival. Every decode step first takes one token from each sequence that
+// is generating and then fills at most n_prefill_chunk tokens of prompt
+// prefill in the same order, so a long prompt is spread over many steps
+// and never holds back the time-between-tokens of interactive sequences.
+
+enum sched_class {
+    SCHED_CLASS_INTERACTIVE = 0,
+    SCHED_CLASS_NORMAL      = 1,
+    SCHED_CLASS_BATCH       = 2,
+    SCHED_CLASS_COUNT,
+};
+
+const char * sched_class_name(sched_class cls);
+bool         sched_class_from_name(const std::string & name, sched_class & cls);
+
+struct sched_entry {
+    int         id  = 0;
+    sched_class cls = SCHED_CLASS_NORMAL;
+    int64_t     t_arrival  = 0; // us
+    int64_t     t_deadline = 0; // us, 0 - none
+};
+
+// true if a should be served before b
+bool sched_before(const sched_entry & a, const sched_entry & b);
+
+// a sequence competing for the next decode step
+struct sched_job {
+    sched_entry entry;
+    int32_t     n_pending = 0;     // tokens waiting to be decoded
+    bool        decoding  = false; // generating (as opposed to prefilling the prompt)
+};
+
+// number of tokens each job gets in the next step (same order as jobs)
+std::vector<int32_t> sched_plan(const std::vector<sched_job> & jobs, int32_t n_batch, int32_t n_prefill_chunk);
+
+// queue depth and admission wait times per class
+struct sched_stats {
+    int32_t n_queued [SCHED_CLASS_COUNT] = {};
+    int64_t n_started[SCHED_CLASS_COUNT] = {};
+    int64_t n_expired[SCHED_CLASS_COUNT] = {};
+    int64_t t_wait   [SCHED_CLASS_COUNT] = {}; // us, sum over started requests
+    int64_t t_wait_max[SCHED_CLASS_COUNT] = {}; // us
+
+    void queued (const sched_entry & e);
+    void started(const sched_entry & e, int64_t t_now);
+    void expired(const sched_entry & e);
+};
@@ -0,0 +1,1441 @@
+#include "server.h"
+
+#include "chat-template.hpp"
+#include "head.h"
+#include "json.hpp"
+#include "kv_pages.h"
+#include "kv_swap.h"
+#include "log.h"
+#include "memory.h"
+#include "models.h"
+#include "prompt_stream.h"
+#include "sampling.h"
+#include "scheduler.h"
+#include "stop.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static std::atomic<bool> g_server_stop{false};
+
+// a client that sends nothing for this long is dropped
+static const int SERVER_RECV_TIMEOUT_S = 30;
+
+// body of a text/plain request, appended by the connection thread while the slot prefills it
+struct server_upload {
+    std::mutex  mutex;
+    std::string text; // received and not taken yet
+    bool        done   = false;
+    bool        failed = false; // the connection ended before the whole body arrived
+};
+
+struct server_request {
+    int fd = -1;
+    int32_t model = 0; // index into server_state::models
+    sched_entry entry;
+    std::vector<llama_token> prompt;
+    int32_t  n_predict = -1;
+    uint32_t seed      = LLAMA_DEFAULT_SEED;
+    std::vector<float> lora; // scale per adapter, empty - the --lora defaults
+    std::vector<std::string> stop;
+    std::vector<std::string>              choices;
+    std::vector<std::vector<llama_token>> choice_tokens;
+    std::shared_ptr<server_upload>        upload; // the prompt is still arriving
+};
+
+struct server_queue {
+    std::mutex                 mutex;
+    std::condition_variable    cv;
+    std::deque<server_request> requests;
+    sched_stats                stats;
+
+    void push(server_request && req) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.queued(req.entry);
+            requests.push_back(std::move(req));
+        }
+        cv.notify_one();
+    }
+
+    // moves the requests past their deadline to expired
+    void expire(std::vector<server_request> & expired) {
+        const int64_t t_now = ggml_time_us();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = requests.begin(); it != requests.end(); ) {
+            if (it->entry.t_deadline != 0 && it->entry.t_deadline < t_now) {
+                stats.expired(it->entry);
+                expired.push_back(std::move(*it));
+                it = requests.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // next request for model in scheduling order
+    bool pop(server_request & req, int32_t model) {
+        const int64_t t_now = ggml_time_us();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto best = requests.end();
+        for (auto it = requests.begin(); it != requests.end(); ++it) {
+            if (it->model == model && (best == requests.end() || sched_before(it->entry, best->entry))) {
+                best = it;
+            }
+        }
+        if (best == requests.end()) {
+            return false;
+        }
+        stats.started(best->entry, t_now);
+        req = std::move(*best);
+        requests.erase(best);
+        return true;
+    }
+
+    sched_stats get_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    void wait(int ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, std::chrono::milliseconds(ms), [this] { return !requests.empty() || g_server_stop; });
+    }
+};
+
+struct server_slot {
+    llama_seq_id id = 0;
+
+    int fd = -1; // connection of the active request, -1 - idle
+    sched_entry entry;
+
+    std::vector<llama_token> cache;   // tokens in the KV cache of this sequence
+    std::vector<llama_token> pending; // tokens still to be decoded (prompt or the last sampled token)
+
+    common_sampler * smpl = nullptr;
+
+    int32_t n_prompt  = 0;
+    int32_t n_predict = -1;
+    int32_t n_decoded = 0;
+    int32_t i_batch   = -1; // index of the logits of this slot in the current batch
+    int32_t lora      = 0;  // adapter set the cache was computed with, index into server_context::lora_sets
+
+    std::string partial; // incomplete UTF-8 sequence or possible start of a stop string held back from the stream
+    stop_matcher stop;
+
+    // a request with "choices" only ever samples among the next tokens of the choices that
+    // still match what it generated so far
+    std::vector<std::string>              choices;
+    std::vector<std::vector<llama_token>> choice_tokens;
+    std::vector<llama_token>              chosen;
+    std::vector<llama_token>              candidates;
+    int32_t                               choice     = -1;
+    int32_t                               choice_end = -1; // the choice chosen completes, picked by sampling EOS
+
+    // a prompt that is still arriving: its stable tokens are prefilled meanwhile, and
+    // nothing is sampled until all of it is there
+    std::shared_ptr<server_upload> upload;
+    std::unique_ptr<prompt_stream> stream;
+
+    int64_t t_start = 0; // admitted to the slot
+    int64_t t_first = 0; // first sampled token
+    int64_t t_idle  = 0; // last request ended
+
+    bool active() const { return fd >= 0; }
+};
+
+// one served model with its own context and slots
+struct server_context {
+    common_params & params;
+    const options & opts;
+
+    std::string         name;
+    llama_model       * model;
+    llama_context     * ctx;
+    const llama_vocab * vocab; // of this model, requests routed here are tokenized with it
+    bool                own_ctx;
+
+    // adapters loaded at startup (--lora); a request picks their scales, and since adapters
+    // apply to the whole context, sequences with different scales are decoded separately
+    std::vector<common_adapter_lora_info> loras;
+    std::vector<std::vector<float>>       lora_sets; // scale sets in use, [0] - the defaults
+    int32_t                               lora_applied = -1;
+
+    common_chat_templates templates;
+
+    // output rows for requests with "choices", opened on first use
+    std::string                path;
+    std::unique_ptr<head_rows> head;
+    std::vector<float>         head_logits;
+
+    kv_pages     pages;
+    kv_swap      swap;
+    llama_batch  batch;
+
+    std::vector<server_slot> slots;
+
+    std::atomic<int> n_active{0};
+    std::atomic<int> n_kv_free{0};
+    std::atomic<int> n_swapped{0};
+    std::atomic<size_t> n_swapped_bytes{0};
+
+    server_context(common_params & params, const options & opts, const std::string & name,
+            const std::string & path, llama_model * model, llama_context * ctx,
+            bool own_ctx, const std::vector<common_adapter_lora_info> & loras) :
+        params(params), opts(opts), name(name), model(model), ctx(ctx), vocab(llama_model_get_vocab(model)),
+        own_ctx(own_ctx), loras(loras), templates(common_chat_templates_from_model(model, params.chat_template)),
+        path(path), pages(ctx), swap(ctx, opts.kv_swap, (size_t) opts.n_kv_swap_max * 1048576) {
+        lora_sets.emplace_back();
+        for (const auto & la : loras) {
+            lora_sets[0].push_back(la.scale);
+        }
+        batch = llama_batch_init(std::max(params.n_batch, (int32_t) llama_n_seq_max(ctx)), 0, 1);
+        slots.resize(llama_n_seq_max(ctx));
+        for (size_t i = 0; i < slots.size(); i++) {
+            slots[i].id = (llama_seq_id) i;
+        }
+    }
+
+    ~server_context() {
+        for (auto & slot : slots) {
+            common_sampler_free(slot.smpl);
+        }
+        llama_batch_free(batch);
+        if (own_ctx) {
+            llama_free(ctx);
+        }
+    }
+};
+
+// what the connection threads share: the request queue and the served models
+struct server_state {
+    common_params & params;
+    const options & opts;
+
+    model_registry registry;
+    server_queue   queue;
+
+    std::vector<std::unique_ptr<server_context>> models; // models[0] - the -m model
+
+    std::atomic<int> n_requests{0};
+
+    // connection threads still running, each with a duplicate of its socket that
+    // shutdown() uses to wake it from a blocking recv()
+    std::mutex              conn_mutex;
+    std::condition_variable conn_cv;
+    std::set<int>           conn_fds;
+    int                     n_conn = 0;
+
+    server_state(common_params & params, const options & opts) : params(params), opts(opts), registry(params) {}
+
+    ~server_state() {
+        while (!models.empty()) {
+            llama_model * model = models.back()->model;
+            models.pop_back();
+            registry.release(model);
+        }
+    }
+
+    int32_t find(const std::string & name) const {
+        for (size_t i = 0; i < models.size(); i++) {
+            if (models[i]->name == name) {
+                return (int32_t) i;
+            }
+        }
+        return -1;
+    }
+};
+
+static bool send_all(int fd, const std::string & s) {
+    size_t n = 0;
+    while (n < s.size()) {
+        const ssize_t k = send(fd, s.data() + n, s.size() - n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return false;
+        }
+        n += (size_t) k;
+    }
+    return true;
+}
+
+static void send_json(int fd, int status, const char * reason, const json & body) {
+    const std::string s = body.dump();
+    char header[256];
+    snprintf(header, sizeof(header),
+            "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            status, reason, s.size());
+    send_all(fd, header + s);
+}
+
+static bool send_event(int fd, const json & data) {
+    return send_all(fd, "data: " + data.dump() + "\n\n");
+}
+
+// number of bytes at the end of s that belong to an incomplete UTF-8 sequence
+static size_t utf8_incomplete(const std::string & s) {
+    for (size_t i = 1; i <= 4 && i <= s.size(); i++) {
+        const unsigned char c = s[s.size() - i];
+        if ((c & 0xC0) == 0x80) {
+            continue; // continuation byte
+        }
+        const size_t n = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return n > i ? i : 0;
+    }
+    return 0;
+}
+
+// reads the header; body gets what arrived of the body with it
+static bool read_header(int fd, std::string & method, std::string & path, std::string & content_type,
+        size_t & content_length, std::string & body) {
+    std::string buf;
+    char tmp[4096];
+    size_t header_end;
+    while ((header_end = buf.find("\r\n\r\n")) == std::string::npos) {
+        if (buf.size() > 64 * 1024) {
+            return false;
+        }
+        const ssize_t k = recv(fd, tmp, sizeof(tmp), 0);
+        if (k <= 0) {
+            return false;
+        }
+        buf.append(tmp, (size_t) k);
+    }
+    const std::string header = buf.substr(0, header_end);
+    const size_t sp0 = header.find(' ');
+    const size_t sp1 = header.find(' ', sp0 + 1);
+    if (sp0 == std::string::npos || sp1 == std::string::npos) {
+        return false;
+    }
+    method = header.substr(0, sp0);
+    path   = header.substr(sp0 + 1, sp1 - sp0 - 1);
+
+    content_length = 0;
+    std::string lower = header;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    const size_t cl = lower.find("\r\ncontent-length:");
+    if (cl != std::string::npos) {
+        content_length = strtoull(lower.c_str() + cl + strlen("\r\ncontent-length:"), nullptr, 10);
+    }
+    if (content_length > 64 * 1024 * 1024) {
+        return false;
+    }
+    content_type.clear();
+    const size_t ct = lower.find("\r\ncontent-type:");
+    if (ct != std::string::npos) {
+        const size_t b = lower.find_first_not_of(' ', ct + strlen("\r\ncontent-type:"));
+        if (b != std::string::npos) {
+            content_type = lower.substr(b, lower.find_first_of(";\r", b) - b);
+        }
+    }
+    body = buf.substr(header_end + 4);
+    return true;
+}
+
+static bool read_body(int fd, size_t content_length, std::string & body) {
+    char tmp[4096];
+    while (body.size() < content_length) {
+        const ssize_t k = recv(fd, tmp, std::min(sizeof(tmp), content_length - body.size()), 0);
+        if (k <= 0) {
+            return false;
+        }
+        body.append(tmp, (size_t) k);
+    }
+    return true;
+}
+
+// %XX escapes and '+' of a URL query component
+static std::string url_decode(const std::string & s) {
+    std::string r;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '+') {
+            r += ' ';
+        } else if (s[i] == '%' && i + 2 < s.size() && isxdigit((unsigned char) s[i + 1]) && isxdigit((unsigned char) s[i + 2])) {
+            r += (char) std::stoi(s.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            r += s[i];
+        }
+    }
+    return r;
+}
+
+// a=1&b=x of a URL as {"a": 1, "b": "x"}
+static json query_params(const std::string & query) {
+    json data = json::object();
+    for (const std::string & kv : string_split<std::string>(query, '&')) {
+        const size_t eq = kv.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        const std::string value = url_decode(kv.substr(eq + 1));
+        const json number = json::parse(value, nullptr, false);
+        data[url_decode(kv.substr(0, eq))] = number.is_number() ? number : json(value);
+    }
+    return data;
+}
+
+// the body of a text/plain request goes to the slot as it arrives; the slot closes the
+// connection whenever it is done with it, so the body is read from in, a duplicate taken
+// before the request was queued, which is closed here
+static void server_upload_body(int in, size_t content_length, const std::string & head, server_upload & upload) {
+    size_t n = head.size();
+    {
+        std::lock_guard<std::mutex> lock(upload.mutex);
+        upload.text += head;
+    }
+    char tmp[1 << 16];
+    while (in >= 0 && n < content_length) {
+        const ssize_t k = recv(in, tmp, std::min(sizeof(tmp), content_length - n), 0);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            break;
+        }
+        n += (size_t) k;
+        std::lock_guard<std::mutex> lock(upload.mutex);
+        upload.text.append(tmp, (size_t) k);
+    }
+    {
+        std::lock_guard<std::mutex> lock(upload.mutex);
+        upload.done   = true;
+        upload.failed = n < content_length;
+    }
+    if (in >= 0) {
+        close(in);
+    }
+}
+
+// runs on its own thread per connection: parse, tokenize and queue the request
+static void server_connection(server_state & state, int fd) {
+    std::string method;
+    std::string path;
+    std::string content_type;
+    size_t      content_length = 0;
+    std::string body;
+    if (!read_header(fd, method, path, content_type, content_length, body)) {
+        close(fd);
+        return;
+    }
+    const size_t i_query = path.find('?');
+    const std::string query = i_query == std::string::npos ? "" : path.substr(i_query + 1);
+    path = path.substr(0, i_query);
+
+    // a text/plain body is the prompt itself, prefilled while it arrives; the other
+    // parameters are in the query string
+    const bool streamed = method == "POST" && content_type == "text/plain";
+    if (!streamed && !read_body(fd, content_length, body)) {
+        close(fd);
+        return;
+    }
+    if (method == "GET" && path == "/health") {
+        const sched_stats stats = state.queue.get_stats();
+        json queue = json::object();
+        for (int i = 0; i < SCHED_CLASS_COUNT; i++) {
+            queue[sched_class_name((sched_class) i)] = {
+                {"queued",      stats.n_queued[i]},
+                {"started",     stats.n_started[i]},
+                {"expired",     stats.n_expired[i]},
+                {"wait_ms_avg", stats.n_started[i] > 0 ? stats.t_wait[i] / 1e3 / stats.n_started[i] : 0.0},
+                {"wait_ms_max", stats.t_wait_max[i] / 1e3},
+            };
+        }
+        json models = json::object();
+        for (const auto & srv : state.models) {
+            models[srv->name] = {
+                {"slots",     srv->slots.size()},
+                {"active",    srv->n_active.load()},
+                {"kv_free",   srv->n_kv_free.load()},
+                {"swapped",   srv->n_swapped.load()},
+                {"swapped_mib", srv->n_swapped_bytes.load() / 1048576.0},
+            };
+            if (!srv->loras.empty()) {
+                json loras = json::array();
+                for (size_t i = 0; i < srv->loras.size(); i++) {
+                    loras.push_back({{"id", i}, {"path", srv->loras[i].path}, {"scale", srv->loras[i].scale}});
+                }
+                models[srv->name]["lora"] = loras;
+            }
+        }
+        json health = {
+            {"status",    "ok"},
+            {"models",    models},
+            {"queue",     queue},
+        };
+        if (state.opts.n_mem_budget > 0) {
+            health["memory"] = {
+                {"rss_mib",    mem_rss() / 1048576.0},
+                {"peak_mib",   mem_rss_peak() / 1048576.0},
+                {"budget_mib", state.opts.n_mem_budget},
+            };
+        }
+        send_json(fd, 200, "OK", health);
+        close(fd);
+        return;
+    }
+    if (method != "POST" || path != "/completion") {
+        send_json(fd, 404, "Not Found", {{"error", "unknown endpoint"}});
+        close(fd);
+        return;
+    }
+    // the KV cache and buffers are allocated up front, so growth beyond the budget comes from
+    // elsewhere (connections, adapters, the allocator); new work waits until it is back
+    if (state.opts.n_mem_budget > 0 && mem_rss() > (size_t) state.opts.n_mem_budget * 1048576) {
+        send_json(fd, 503, "Service Unavailable", {{"error", "over the memory budget"}});
+        close(fd);
+        return;
+    }
+    server_request req;
+    try {
+        const json data = streamed ? query_params(query) : json::parse(body);
+        if (data.contains("model")) {
+            req.model = state.find(data.at("model").get<std::string>());
+            if (req.model < 0) {
+                send_json(fd, 404, "Not Found", {{"error", "unknown model"}});
+                close(fd);
+                return;
+            }
+        }
+        const server_context & srv = *state.models[req.model];
+        std::string prompt;
+        if (streamed) {
+            req.upload = std::make_shared<server_upload>();
+        } else if (data.contains("messages")) {
+            std::vector<common_chat_msg> msgs;
+            for (const auto & m : data.at("messages")) {
+                msgs.push_back({m.at("role").get<std::string>(), m.at("content").get<std::string>(), {}});
+            }
+            prompt = common_chat_apply_template(*srv.templates.template_default, msgs, true, srv.params.use_jinja);
+        } else {
+            prompt = data.at("prompt").get<std::string>();
+        }
+        if (!streamed) {
+            TRACE_SCOPE("tokenize");
+            req.prompt = common_tokenize(srv.vocab, prompt, true, true);
+        }
+        req.n_predict = data.value("n_predict", srv.params.n_predict);
+        req.seed      = data.value("seed", srv.params.sampling.seed);
+        if (data.contains("stop")) {
+            const json & stop = data.at("stop");
+            req.stop = stop.is_string() ? std::vector<std::string>{stop.get<std::string>()} : stop.get<std::vector<std::string>>();
+        }
+        if (data.contains("lora")) {
+            // [{"id": 0, "scale": 0.5}, ...], adapters not listed keep their --lora scale
+            for (const auto & la : srv.loras) {
+                req.lora.push_back(la.scale);
+            }
+            for (const auto & l : data.at("lora")) {
+                const int id = l.at("id").get<int>();
+                if (id < 0 || id >= (int) req.lora.size()) {
+                    throw std::invalid_argument("unknown lora id");
+                }
+                req.lora[id] = l.value("scale", 1.0f);
+            }
+        }
+        if (data.contains("choices")) {
+            // the completion is one of these strings, n_predict and stop do not apply
+            req.choices = data.at("choices").get<std::vector<std::string>>();
+            for (const std::string & c : req.choices) {
+                req.choice_tokens.push_back(common_tokenize(srv.vocab, c, false, false));
+                if (req.choice_tokens.back().empty()) {
+                    throw std::invalid_argument("choices must not be empty strings");
+                }
+            }
+            if (req.choices.empty()) {
+                throw std::invalid_argument("choices must not be empty");
+            }
+        }
+        if (data.contains("priority") &&
+            !sched_class_from_name(data.at("priority").get<std::string>(), req.entry.cls)) {
+            throw std::invalid_argument("priority must be one of: interactive, normal, batch");
+        }
+        req.entry.t_arrival = ggml_time_us();
+        if (data.contains("deadline_ms")) {
+            // the request has to be admitted to a slot within deadline_ms
+            req.entry.t_deadline = req.entry.t_arrival + (int64_t) (data.at("deadline_ms").get<double>() * 1e3);
+        }
+    } catch (const std::exception & e) {
+        send_json(fd, 400, "Bad Request", {{"error", e.what()}});
+        close(fd);
+        return;
+    }
+    if (streamed && content_length == 0) {
+        send_json(fd, 411, "Length Required", {{"error", "a streamed prompt needs Content-Length"}});
+        close(fd);
+        return;
+    }
+    if (!streamed && (req.prompt.empty() || (int) req.prompt.size() >= (int) llama_n_ctx(state.models[req.model]->ctx) - 4)) {
+        send_json(fd, 400, "Bad Request", {{"error", "prompt is empty or does not fit into the context"}});
+        close(fd);
+        return;
+    }
+    if (!send_all(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n") ||
+        g_server_stop) {
+        close(fd);
+        return;
+    }
+    req.fd = fd;
+    req.entry.id = ++state.n_requests;
+    std::shared_ptr<server_upload> upload = req.upload;
+    const int in = upload ? dup(fd) : -1; // fd belongs to the main loop once queued
+    state.queue.push(std::move(req));
+    if (upload) {
+        server_upload_body(in, content_length, body, *upload);
+    }
+}
+
+static void server_connection_thread(server_state & state, int fd) {
+    const int own = dup(fd);
+    {
+        std::lock_guard<std::mutex> lock(state.conn_mutex);
+        if (own >= 0) {
+            state.conn_fds.insert(own);
+        }
+    }
+    server_connection(state, fd);
+    {
+        std::lock_guard<std::mutex> lock(state.conn_mutex);
+        state.conn_fds.erase(own);
+        state.n_conn--;
+    }
+    if (own >= 0) {
+        close(own);
+    }
+    state.conn_cv.notify_all();
+}
+
+static int server_listen(const std::string & addr) {
+    int fd = -1;
+    if (addr.find('/') != std::string::npos) {
+        sockaddr_un sa = {};
+        if (addr.size() >= sizeof(sa.sun_path)) {
+            LOG_ERR("%s: socket path is too long: '%s'\n", __func__, addr.c_str());
+            return -1;
+        }
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, addr.c_str());
+        unlink(addr.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (sockaddr *) &sa, sizeof(sa)) != 0) {
+            LOG_ERR("%s: failed to bind '%s': %s\n", __func__, addr.c_str(), strerror(errno));
+            if (fd >= 0) { close(fd); }
+            return -1;
+        }
+    } else {
+        sockaddr_in sa = {};
+        sa.sin_family      = AF_INET;
+        sa.sin_port        = htons((uint16_t) atoi(addr.c_str()));
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        const int one = 1;
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (fd < 0 || bind(fd, (sockaddr *) &sa, sizeof(sa)) != 0) {
+            LOG_ERR("%s: failed to bind 127.0.0.1:%s: %s\n", __func__, addr.c_str(), strerror(errno));
+            if (fd >= 0) { close(fd); }
+            return -1;
+        }
+    }
+    if (listen(fd, 64) != 0) {
+        LOG_ERR("%s: listen failed: %s\n", __func__, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void slot_finish(server_context & srv, server_slot & slot, const char * stop_type) {
+    const int64_t t_end = ggml_time_us();
+    const double t_prompt_ms = (slot.t_first - slot.t_start) / 1e3;
+    const double t_gen_ms    = (t_end - slot.t_first) / 1e3;
+    json event = {
+        {"id",        slot.entry.id},
+        {"content",   slot.partial},
+        {"stop",      true},
+        {"stop_type", stop_type},
+        {"timings", {
+            {"queued_ms", (slot.t_start - slot.entry.t_arrival) / 1e3},
+            {"prompt_n",  slot.n_prompt},
+            {"prompt_ms", t_prompt_ms},
+            {"predicted_n",  slot.n_decoded},
+            {"predicted_ms", t_gen_ms},
+            {"predicted_per_second", t_gen_ms > 0 ? 1e3 * slot.n_decoded / t_gen_ms : 0.0},
+        }},
+    };
+    if (slot.choice >= 0) {
+        event["choice"] = slot.choice;
+    }
+    send_event(slot.fd, event);
+    LOG_INF("%s: slot %d request %d %s: prompt %d tokens %.1f ms, generated %d tokens %.1f ms\n", __func__,
+            slot.id, slot.entry.id, stop_type, slot.n_prompt, t_prompt_ms, slot.n_decoded, t_gen_ms);
+    if (slot.upload) {
+        // ends the read of the connection thread
+        shutdown(slot.fd, SHUT_RD);
+        slot.upload.reset();
+        slot.stream.reset();
+    }
+    close(slot.fd);
+    slot.fd = -1;
+    slot.pending.clear();
+    slot.partial.clear();
+    slot.t_idle = t_end;
+    srv.n_active--;
+}
+
+// drop the cells of an idle slot, writing them to disk first when swapping is on
+static void slot_swap_out(server_context & srv, server_slot & slot) {
+    if (srv.swap.swap_out(slot.id, slot.cache, slot.lora)) {
+        LOG_INF("%s: slot %d: %zu tokens swapped out\n", __func__, slot.id, slot.cache.size());
+    }
+    srv.pages.release(slot.id);
+    slot.cache.clear();
+}
+
+// the idle slot other than seq_id that holds cells and was used least recently, nullptr if none
+static server_slot * slots_lru_idle(server_context & srv, llama_seq_id seq_id = -1) {
+    server_slot * lru = nullptr;
+    for (auto & slot : srv.slots) {
+        if (!slot.active() && !slot.cache.empty() && slot.id != seq_id && (!lru || slot.t_idle < lru->t_idle)) {
+            lru = &slot;
+        }
+    }
+    return lru;
+}
+
+// drop the cached KV of idle slots, least recently used first, until n_tokens fit into seq_id
+static bool slots_evict_idle(server_context & srv, llama_seq_id seq_id, int32_t n_tokens) {
+    while (!srv.pages.can_append(seq_id, n_tokens)) {
+        server_slot * lru = slots_lru_idle(srv, seq_id);
+        if (!lru) {
+            return false;
+        }
+        slot_swap_out(srv, *lru);
+    }
+    return true;
+}
+
+// swap out slots that have been idle for longer than --kv-swap-idle
+static void slots_swap_idle(server_context & srv) {
+    if (!srv.swap.enabled()) {
+        return;
+    }
+    const int64_t t_min = ggml_time_us() - (int64_t) srv.opts.n_kv_swap_idle * 1000000;
+    for (auto & slot : srv.slots) {
+        if (!slot.active() && !slot.cache.empty() && slot.t_idle < t_min) {
+            slot_swap_out(srv, slot);
+        }
+    }
+    srv.n_swapped       = (int) srv.swap.n_entries();
+    srv.n_swapped_bytes = srv.swap.n_bytes();
+}
+
+// read swapped-out session i back into an idle slot in place of what the slot holds
+static bool slot_swap_in(server_context & srv, server_slot & slot, int32_t i) {
+    // making room swaps out other sessions, which may remove old files and shift the indices
+    const std::string path     = srv.swap.at(i).path;
+    const size_t      n_tokens = srv.swap.at(i).tokens.size();
+    slot_swap_out(srv, slot);
+    if (!slots_evict_idle(srv, slot.id, (int32_t) n_tokens)) {
+        return false;
+    }
+    i = srv.swap.index_of(path);
+    if (i < 0) {
+        LOG_INF("%s: slot %d: the session was removed beyond --kv-swap-max while making room\n", __func__, slot.id);
+        return false;
+    }
+    if (!srv.pages.append(slot.id, (int32_t) n_tokens)) {
+        return false;
+    }
+    const int64_t t_start = ggml_time_us();
+    if (!srv.swap.swap_in(i, slot.id, slot.cache)) {
+        srv.pages.release(slot.id);
+        return false;
+    }
+    LOG_INF("%s: slot %d: %zu tokens swapped in in %.1f ms\n", __func__, slot.id, slot.cache.size(),
+            (ggml_time_us() - t_start) / 1e3);
+    return true;
+}
+
+// whether a slot, a swapped session or the applied adapters still refer to adapter set i
+static bool server_lora_used(const server_context & srv, int32_t i) {
+    if (i == 0 || srv.lora_applied == i) {
+        return true;
+    }
+    for (const auto & slot : srv.slots) {
+        if (slot.lora == i) {
+            return true;
+        }
+    }
+    for (size_t j = 0; j < srv.swap.n_entries(); j++) {
+        if (srv.swap.at((int32_t) j).tag == i) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// index of the adapter scale set in lora_sets; a new set takes the place of one nothing refers
+// to any more, so there are at most two more sets than slots and swapped sessions
+static int32_t server_lora_set(server_context & srv, const std::vector<float> & scales) {
+    if (scales.empty()) {
+        return 0;
+    }
+    for (size_t i = 0; i < srv.lora_sets.size(); i++) {
+        if (srv.lora_sets[i] == scales) {
+            return (int32_t) i;
+        }
+    }
+    for (size_t i = 1; i < srv.lora_sets.size(); i++) {
+        if (!server_lora_used(srv, (int32_t) i)) {
+            srv.lora_sets[i] = scales;
+            return (int32_t) i;
+        }
+    }
+    srv.lora_sets.push_back(scales);
+    return (int32_t) srv.lora_sets.size() - 1;
+}
+
+// switching adapters only changes what the next graph is built with: no reload, and the
+// cells of other sequences stay valid for the adapters they were computed with
+static void server_lora_apply(server_context & srv, int32_t lora) {
+    if (srv.loras.empty() || srv.lora_applied == lora) {
+        return;
+    }
+    const int64_t t_start = ggml_time_us();
+    llama_clear_adapter_lora(srv.ctx);
+    const std::vector<float> & scales = srv.lora_sets[lora];
+    for (size_t i = 0; i < srv.loras.size(); i++) {
+        if (scales[i] != 0.0f) {
+            llama_set_adapter_lora(srv.ctx, srv.loras[i].ptr, scales[i]);
+        }
+    }
+    srv.lora_applied = lora;
+    LOG_DBG("%s: adapter set %d applied in %.1f us\n", __func__, lora, (double) (ggml_time_us() - t_start));
+}
+
+// next tokens of the choices that begin with what the slot generated so far, plus EOS when one
+// of them is complete but longer ones go on ("yes" and "yes, please"); returns the choice that
+// is decided, -1 while it is still open
+static int32_t slot_choice_candidates(const server_context & srv, server_slot & slot) {
+    slot.candidates.clear();
+    slot.choice_end = -1;
+    int32_t i_last   = -1;
+    int32_t n_longer = 0;
+    for (size_t i = 0; i < slot.choice_tokens.size(); i++) {
+        const std::vector<llama_token> & c = slot.choice_tokens[i];
+        if (c.size() < slot.chosen.size() || !std::equal(slot.chosen.begin(), slot.chosen.end(), c.begin())) {
+            continue;
+        }
+        if (c.size() == slot.chosen.size()) {
+            if (slot.choice_end < 0) {
+                slot.choice_end = (int32_t) i;
+            }
+            continue;
+        }
+        n_longer++;
+        i_last = (int32_t) i;
+        const llama_token next = c[slot.chosen.size()];
+        if (std::find(slot.candidates.begin(), slot.candidates.end(), next) == slot.candidates.end()) {
+            slot.candidates.push_back(next);
+        }
+    }
+    if (slot.choice_end >= 0) {
+        if (n_longer == 0) {
+            return slot.choice_end;
+        }
+        const llama_token eos = llama_vocab_eos(srv.vocab);
+        if (std::find(slot.candidates.begin(), slot.candidates.end(), eos) == slot.candidates.end()) {
+            slot.candidates.push_back(eos);
+        }
+        return -1;
+    }
+    return n_longer == 1 ? i_last : -1;
+}
+
+// the candidate with the highest logit for output i of the last decode
+static llama_token slot_choice_sample(server_context & srv, server_slot & slot, int32_t i_out) {
+    const float * h = srv.head && srv.head->ok() ? head_hidden(i_out) : nullptr;
+    if (h) {
+        srv.head->logits(h, slot.candidates, srv.head_logits);
+    } else {
+        // the decode ran the full output head
+        const float * logits = llama_get_logits_ith(srv.ctx, slot.i_batch);
+        srv.head_logits.clear();
+        for (llama_token id : slot.candidates) {
+            srv.head_logits.push_back(logits[id]);
+        }
+    }
+    const size_t i_max = std::max_element(srv.head_logits.begin(), srv.head_logits.end()) - srv.head_logits.begin();
+    return slot.candidates[i_max];
+}
+
+// take a queued request into the idle slot with the longest cached prefix
+static bool slot_assign(server_context & srv, server_request & req) {
+    const int32_t lora = server_lora_set(srv, req.lora);
+    server_slot * best = nullptr;
+    size_t n_best = 0;
+    for (auto & slot : srv.slots) {
+        if (slot.active()) {
+            continue;
+        }
+        // a cache computed with other adapters is of no use
+        size_t n = 0;
+        while (slot.lora == lora && n < slot.cache.size() && n < req.prompt.size() && slot.cache[n] == req.prompt[n]) {
+            n++;
+        }
+        if (!best || n > n_best) {
+            best   = &slot;
+            n_best = n;
+        }
+    }
+    if (!best) {
+        return false;
+    }
+    server_slot & slot = *best;
+    if (req.upload) {
+        // the prompt is still arriving, slot_upload() matches it against the cache as it grows
+        if (slot.lora != lora) {
+            srv.pages.truncate(slot.id, 0);
+            slot.cache.clear();
+        }
+        slot.pending.clear();
+        slot.upload = std::move(req.upload);
+        slot.stream = std::make_unique<prompt_stream>(srv.vocab, srv.opts.n_prompt_step);
+    } else {
+        size_t n_swapped = 0;
+        const int32_t i_swap = srv.swap.find(req.prompt, n_swapped, lora);
+        if (i_swap >= 0 && n_swapped > n_best) {
+            // a swapped-out session shares more of the prompt than anything in memory
+            // what was actually restored decides how much of the prompt is cached
+            n_best = slot_swap_in(srv, slot, i_swap) ? prompt_common_prefix(slot.cache, req.prompt) : 0;
+        }
+        if (n_best == req.prompt.size()) {
+            n_best--; // the last prompt token is decoded again for its logits
+        }
+        srv.pages.truncate(slot.id, (int32_t) n_best);
+        slot.cache.resize(n_best);
+        slot.pending.assign(req.prompt.begin() + n_best, req.prompt.end());
+    }
+    slot.lora = lora;
+
+    common_params_sampling sparams = srv.params.sampling;
+    sparams.seed = req.seed;
+    common_sampler_free(slot.smpl);
+    slot.smpl = common_sampler_init(srv.model, sparams);
+    for (llama_token id : req.prompt) {
+        common_sampler_accept(slot.smpl, id, false);
+    }
+
+    slot.stop       = stop_matcher(req.stop, {});
+    slot.choices       = std::move(req.choices);
+    slot.choice_tokens = std::move(req.choice_tokens);
+    slot.chosen.clear();
+    slot.choice     = slot_choice_candidates(srv, slot);
+    if (!slot.choices.empty() && !srv.head && srv.opts.n_choice_head > 0) {
+        srv.head = std::make_unique<head_rows>(srv.path);
+        if (!srv.head->ok()) {
+            LOG_WRN("%s: %s: choices fall back to the full output head\n", __func__, srv.name.c_str());
+        }
+    }
+    slot.fd         = req.fd;
+    slot.entry      = req.entry;
+    slot.n_prompt   = (int32_t) req.prompt.size();
+    slot.n_predict  = req.n_predict;
+    slot.n_decoded  = 0;
+    slot.t_start    = ggml_time_us();
+    slot.t_first    = slot.t_start;
+    srv.n_active++;
+    LOG_INF("%s: %s slot %d request %d: prompt %zu tokens, %zu cached\n", __func__, srv.name.c_str(), slot.id, slot.entry.id,
+            req.prompt.size(), n_best);
+    if (slot.choice >= 0) {
+        // a single choice needs no decode at all
+        slot.partial = slot.choices[slot.choice];
+        slot_finish(srv, slot, "choice");
+    }
+    return true;
+}
+
+// takes what arrived of a streamed prompt: its stable tokens are matched against the cache
+// and whatever differs is queued for prefill; once all of it is there the slot starts sampling
+static void slot_upload(server_context & srv, server_slot & slot) {
+    bool done;
+    bool failed;
+    {
+        std::lock_guard<std::mutex> lock(slot.upload->mutex);
+        slot.stream->append(slot.upload->text);
+        slot.upload->text.clear();
+        done   = slot.upload->done;
+        failed = slot.upload->failed;
+    }
+    if (failed) {
+        LOG_INF("%s: slot %d request %d: the prompt did not arrive\n", __func__, slot.id, slot.entry.id);
+        slot_finish(srv, slot, "error");
+        return;
+    }
+    std::vector<llama_token> tokens;
+    if (done) {
+        TRACE_SCOPE("tokenize", slot.id);
+        tokens = slot.stream->finish();
+    } else if (!slot.stream->stable(tokens)) {
+        return;
+    }
+    if (done && tokens.empty()) {
+        slot_finish(srv, slot, "error");
+        return;
+    }
+    if ((int) tokens.size() >= (int) llama_n_ctx(srv.ctx) - 4) {
+        slot_finish(srv, slot, "limit");
+        return;
+    }
+
+    // cells beyond what still matches are dropped, but while the prompt is arriving a longer
+    // cache that agrees so far is kept: the rest of the prompt may match it too
+    const size_t n_seq = slot.cache.size() + slot.pending.size();
+    size_t n_keep = prompt_common_prefix(slot.cache, tokens);
+    if (n_keep == slot.cache.size()) {
+        while (n_keep < n_seq && n_keep < tokens.size() && slot.pending[n_keep - slot.cache.size()] == tokens[n_keep]) {
+            n_keep++;
+        }
+    }
+    if (n_keep < n_seq && (n_keep < tokens.size() || done)) {
+        if (n_keep < slot.cache.size()) {
+            srv.pages.truncate(slot.id, (int32_t) n_keep);
+            slot.cache.resize(n_keep);
+            slot.pending.clear();
+        } else {
+            slot.pending.resize(n_keep - slot.cache.size());
+        }
+    }
+    const size_t n_have = slot.cache.size() + slot.pending.size();
+    if (n_have < tokens.size()) {
+        slot.pending.insert(slot.pending.end(), tokens.begin() + n_have, tokens.end());
+    }
+    if (!done) {
+        return;
+    }
+    if (slot.pending.empty()) {
+        // the last prompt token is decoded again for its logits
+        srv.pages.truncate(slot.id, (int32_t) slot.cache.size() - 1);
+        slot.pending.push_back(slot.cache.back());
+        slot.cache.pop_back();
+    }
+    for (llama_token id : tokens) {
+        common_sampler_accept(slot.smpl, id, false);
+    }
+    slot.n_prompt = (int32_t) tokens.size();
+    slot.upload.reset();
+    slot.stream.reset();
+    LOG_INF("%s: slot %d request %d: prompt %zu tokens complete, %zu left to prefill\n", __func__, slot.id, slot.entry.id,
+            tokens.size(), slot.pending.size());
+}
+
+// a closed or reset connection cancels its request
+static void slots_check_cancel(server_context & srv) {
+    std::vector<pollfd> fds;
+    for (auto & slot : srv.slots) {
+        // the connection thread is still reading the prompt from a streamed request
+        if (slot.active() && !slot.upload) {
+            fds.push_back({slot.fd, POLLIN, 0});
+        }
+    }
+    if (fds.empty() || poll(fds.data(), fds.size(), 0) <= 0) {
+        return;
+    }
+    for (auto & slot : srv.slots) {
+        for (const auto & p : fds) {
+            if (p.fd != slot.fd || p.revents == 0) {
+                continue;
+            }
+            char c;
+            if ((p.revents & (POLLHUP | POLLERR)) || recv(slot.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+                LOG_INF("%s: slot %d request %d cancelled\n", __func__, slot.id, slot.entry.id);
+                close(slot.fd);
+                slot.fd = -1;
+                slot.pending.clear();
+                slot.partial.clear();
+                slot.t_idle = ggml_time_us();
+                srv.n_active--;
+            }
+        }
+    }
+}
+
+// decodes the planned tokens of the slots using adapter set lora and samples the next ones;
+// a pruned batch holds only slots with choices and stops before the output matmul
+static void server_decode(server_context & srv, const std::vector<server_slot *> & job_slots,
+        std::vector<int32_t> plan, int32_t lora, bool pruned) {
+    std::vector<int32_t> n_batched(job_slots.size());
+    int32_t ret;
+    for (;;) {
+        const int64_t t_batch = g_trace_enabled ? ggml_time_us() : 0;
+
+        for (auto & slot : srv.slots) {
+            slot.i_batch = -1;
+        }
+        common_batch_clear(srv.batch);
+        for (size_t j = 0; j < job_slots.size(); j++) {
+            server_slot & slot = *job_slots[j];
+            const int32_t n = plan[j];
+            n_batched[j] = 0;
+            if (n == 0 || slot.lora != lora || slot.choices.empty() == pruned || !slot.active()) {
+                continue;
+            }
+            if (!slots_evict_idle(srv, slot.id, n) || !srv.pages.append(slot.id, n)) {
+                slot_finish(srv, slot, "limit");
+                continue;
+            }
+            for (int32_t i = 0; i < n; i++) {
+                const bool last = i == n - 1 && n == (int32_t) slot.pending.size() && !slot.upload;
+                common_batch_add(srv.batch, slot.pending[i], (llama_pos) slot.cache.size() + i, { slot.id }, last);
+            }
+            slot.cache.insert(slot.cache.end(), slot.pending.begin(), slot.pending.begin() + n);
+            slot.pending.erase(slot.pending.begin(), slot.pending.begin() + n);
+            n_batched[j] = n;
+            if (slot.pending.empty() && !slot.upload) {
+                slot.i_batch = srv.batch.n_tokens - 1;
+            }
+        }
+        if (srv.batch.n_tokens == 0) {
+            return;
+        }
+        if (g_trace_enabled) {
+            trace_add("batch", t_batch, ggml_time_us(), srv.batch.n_tokens);
+        }
+        server_lora_apply(srv, lora);
+        {
+            TRACE_SCOPE("decode", srv.batch.n_tokens);
+            trace_decode_begin();
+            head_skip_next(pruned && srv.head && srv.head->ok());
+            ret = llama_decode(srv.ctx, srv.batch);
+            head_skip_next(false);
+        }
+        if (ret != 1) {
+            break;
+        }
+
+        // no contiguous cells for a micro-batch: kv_pages only counts free blocks, which can be
+        // scattered; take the batch back, then free cells or ask for fewer and try again
+        server_slot * largest = nullptr;
+        for (size_t j = 0; j < job_slots.size(); j++) {
+            server_slot & slot = *job_slots[j];
+            const int32_t n = n_batched[j];
+            if (n == 0) {
+                continue;
+            }
+            slot.pending.insert(slot.pending.begin(), slot.cache.end() - n, slot.cache.end());
+            slot.cache.resize(slot.cache.size() - n);
+            srv.pages.truncate(slot.id, (int32_t) slot.cache.size());
+            slot.i_batch = -1;
+            if (!largest || slot.cache.size() > largest->cache.size()) {
+                largest = &slot;
+            }
+        }
+        bool shrunk = false;
+        if (server_slot * lru = slots_lru_idle(srv)) {
+            slot_swap_out(srv, *lru);
+        } else {
+            for (size_t j = 0; j < job_slots.size(); j++) {
+                if (n_batched[j] > 1) {
+                    plan[j] = n_batched[j] / 2;
+                    shrunk  = true;
+                }
+            }
+            if (!shrunk && largest) {
+                // a single token per slot does not fit: the longest sequence gives its cells up
+                slot_finish(srv, *largest, "limit");
+            }
+        }
+        LOG_WRN("%s: no room in the KV cache for %d tokens, %s\n", __func__, srv.batch.n_tokens,
+                shrunk ? "retrying with a smaller batch" : "retrying after freeing cells");
+    }
+    if (ret != 0) {
+        LOG_ERR("%s: llama_decode() failed for %d tokens\n", __func__, srv.batch.n_tokens);
+        for (auto & slot : srv.slots) {
+            if (slot.active()) {
+                slot_finish(srv, slot, "error");
+            }
+            srv.pages.release(slot.id);
+            slot.cache.clear();
+        }
+        return;
+    }
+    for (auto & slot : srv.slots) {
+        if (slot.i_batch < 0 || !slot.active()) {
+            continue;
+        }
+        if (pruned) {
+            const int32_t i_out = (int32_t) std::count(srv.batch.logits, srv.batch.logits + slot.i_batch, 1);
+            const llama_token id = slot_choice_sample(srv, slot, i_out);
+            if (slot.n_decoded++ == 0) {
+                slot.t_first = ggml_time_us();
+            }
+            if (id == llama_vocab_eos(srv.vocab) && slot.choice_end >= 0) {
+                // ending here scored better than going on with a longer choice
+                slot.choice = slot.choice_end;
+            } else {
+                slot.chosen.push_back(id);
+                slot.choice = slot_choice_candidates(srv, slot);
+            }
+            if (slot.choice >= 0) {
+                slot.partial = slot.choices[slot.choice];
+                slot_finish(srv, slot, "choice");
+                continue;
+            }
+            slot.pending.push_back(id);
+            continue;
+        }
+        llama_token id;
+        {
+            TRACE_SCOPE("sample", slot.id);
+            id = common_sampler_sample(slot.smpl, srv.ctx, slot.i_batch);
+            common_sampler_accept(slot.smpl, id, true);
+        }
+        if (slot.n_decoded++ == 0) {
+            slot.t_first = ggml_time_us();
+        }
+        if (llama_vocab_is_eog(srv.vocab, id)) {
+            slot_finish(srv, slot, "eos");
+            continue;
+        }
+        std::string piece;
+        {
+            TRACE_SCOPE("detokenize", slot.id);
+            piece = common_token_to_piece(srv.ctx, id, srv.params.special);
+        }
+        slot.partial += piece;
+        const size_t i_stop = slot.stop.feed(piece);
+        if (i_stop != std::string::npos) {
+            // the stop string and whatever follows it in the token are not sent; its start
+            // was held back, so it is all in partial
+            slot.partial.resize(slot.partial.size() - piece.size() + i_stop - slot.stop.match_len());
+            slot_finish(srv, slot, "stop");
+            continue;
+        }
+        const size_t n_hold = std::min(slot.partial.size(), std::max(utf8_incomplete(slot.partial), slot.stop.n_partial()));
+        if (slot.partial.size() > n_hold) {
+            const std::string content = slot.partial.substr(0, slot.partial.size() - n_hold);
+            slot.partial.erase(0, slot.partial.size() - n_hold);
+            TRACE_SCOPE("output", slot.id);
+            if (!send_event(slot.fd, {{"id", slot.entry.id}, {"content", content}})) {
+                LOG_INF("%s: slot %d request %d: client went away\n", __func__, slot.id, slot.entry.id);
+                close(slot.fd);
+                slot.fd = -1;
+                slot.partial.clear();
+                slot.t_idle = ggml_time_us();
+                srv.n_active--;
+                continue;
+            }
+        }
+        if (slot.n_predict >= 0 && slot.n_decoded >= slot.n_predict) {
+            slot_finish(srv, slot, "length");
+            continue;
+        }
+        slot.pending.push_back(id);
+    }
+}
+
+// returns false when there was nothing to decode
+static bool server_step(server_context & srv) {
+    for (auto & slot : srv.slots) {
+        if (slot.active() && slot.upload) {
+            slot_upload(srv, slot);
+        }
+    }
+    std::vector<sched_job>     jobs;
+    std::vector<server_slot *> job_slots;
+    for (auto & slot : srv.slots) {
+        if (slot.active() && !slot.pending.empty()) {
+            jobs.push_back({slot.entry, (int32_t) slot.pending.size(), slot.n_decoded > 0});
+            job_slots.push_back(&slot);
+        }
+    }
+    const std::vector<int32_t> plan = sched_plan(jobs, srv.params.n_batch, srv.opts.n_prefill_chunk);
+
+    // adapters apply to the whole context, so every adapter set gets its own llama_decode,
+    // and so do slots with choices, whose decode skips the output head
+    std::vector<std::pair<int32_t, bool>> groups;
+    for (size_t j = 0; j < job_slots.size(); j++) {
+        const std::pair<int32_t, bool> g = { job_slots[j]->lora, !job_slots[j]->choices.empty() };
+        if (plan[j] > 0 && std::find(groups.begin(), groups.end(), g) == groups.end()) {
+            groups.push_back(g);
+        }
+    }
+    for (const auto & g : groups) {
+        server_decode(srv, job_slots, plan, g.first, g.second);
+    }
+    return !groups.empty();
+}
+
+int server_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx) {
+    server_state state(params, opts);
+    state.registry.add_loaded(model_name_from_path(params.model), params.model, model);
+    if (!opts.models.empty() && !state.registry.add_list(opts.models)) {
+        return 1;
+    }
+    for (const std::string & name : state.registry.names()) {
+        llama_model * m = state.registry.acquire(name);
+        if (!m) {
+            return 1;
+        }
+        // a further model has to fit beside what is resident already
+        mem_model mm;
+        if (opts.n_mem_budget > 0 && !state.models.empty() && mem_model_read(state.registry.path_of(m), mm)) {
+            const bool shared = std::any_of(state.models.begin(), state.models.end(), [m](const auto & srv) { return srv->model == m; });
+            const size_t need = (shared ? 0 : mm.n_weights) + mem_context_bytes(mm, params);
+            if (mem_rss() + need > (size_t) opts.n_mem_budget * 1048576) {
+                LOG_ERR("%s: model '%s' needs %.0f MiB more than the memory budget allows\n", __func__, name.c_str(),
+                        (mem_rss() + need) / 1048576.0 - opts.n_mem_budget);
+                state.registry.release(m);
+                return 1;
+            }
+        }
+        // -m keeps the context main() created, the others get one each with the same parameters
+        llama_context * c = state.models.empty() ? ctx : llama_init_from_model(m, common_context_params_to_llama(params));
+        if (!c) {
+            LOG_ERR("%s: failed to create a context for '%s'\n", __func__, name.c_str());
+            state.registry.release(m);
+            return 1;
+        }
+        // --lora adapters were loaded for -m only
+        state.models.push_back(std::make_unique<server_context>(params, opts, name, state.registry.path_of(m), m, c, c != ctx,
+                c == ctx ? params.lora_adapters : std::vector<common_adapter_lora_info>()));
+        if (!state.models.back()->templates.template_default) {
+            LOG_ERR("%s: model '%s' has no chat template\n", __func__, name.c_str());
+            return 1;
+        }
+    }
+
+    const int listen_fd = server_listen(opts.serve);
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    {
+        struct sigaction sa = {};
+        sa.sa_handler = [](int) { g_server_stop = true; };
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT,  &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+    }
+
+    std::thread acceptor([&state, listen_fd]() {
+        while (!g_server_stop) {
+            const int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            const timeval tv = { SERVER_RECV_TIMEOUT_S, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            {
+                std::lock_guard<std::mutex> lock(state.conn_mutex);
+                state.n_conn++;
+            }
+            std::thread(server_connection_thread, std::ref(state), fd).detach();
+        }
+    });
+
+    for (const auto & srv : state.models) {
+        LOG_INF("%s: model '%s': slots = %zu, n_ctx = %d, vocab %d, lora adapters = %zu\n", __func__, srv->name.c_str(),
+                srv->slots.size(), llama_n_ctx(srv->ctx), state.registry.vocab_id(srv->model), srv->loras.size());
+    }
+    LOG_INF("%s: listening on %s, n_batch = %d, n_prefill_chunk = %d\n", __func__,
+            opts.serve.c_str(), params.n_batch, opts.n_prefill_chunk);
+
+    while (!g_server_stop) {
+        // swept on every iteration: with all slots busy, pop() is not called for a whole generation
+        std::vector<server_request> expired;
+        state.queue.expire(expired);
+        int n_active = 0;
+        for (size_t i = 0; i < state.models.size(); i++) {
+            server_context & srv = *state.models[i];
+            server_request req;
+            while (srv.n_active < (int) srv.slots.size() && state.queue.pop(req, (int32_t) i)) {
+                slot_assign(srv, req);
+            }
+            slots_swap_idle(srv);
+            n_active += srv.n_active;
+        }
+        for (auto & r : expired) {
+            LOG_INF("%s: request %d missed its deadline in the queue\n", __func__, r.entry.id);
+            send_event(r.fd, {{"id", r.entry.id}, {"content", ""}, {"stop", true}, {"stop_type", "deadline"}});
+            close(r.fd);
+        }
+        if (n_active == 0) {
+            for (auto & srv : state.models) {
+                srv->n_kv_free = srv->pages.n_free();
+            }
+            state.queue.wait(100);
+            continue;
+        }
+        bool busy = false;
+        for (auto & srv : state.models) {
+            if (srv->n_active == 0) {
+                continue;
+            }
+            slots_check_cancel(*srv);
+            busy |= server_step(*srv);
+            srv->n_kv_free = srv->pages.n_free();
+        }
+        if (!busy) {
+            // only waiting for streamed prompts
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    LOG_INF("%s: shutting down\n", __func__);
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    acceptor.join();
+    for (auto & srv : state.models) {
+        for (auto & slot : srv->slots) {
+            if (slot.active()) {
+                slot_finish(*srv, slot, "shutdown");
+            }
+        }
+    }
+    if (opts.serve.find('/') != std::string::npos) {
+        unlink(opts.serve.c_str());
+    }
+    for (auto & r : state.queue.requests) {
+        close(r.fd);
+    }
+    // the connection threads use state, which goes away with this frame
+    {
+        std::unique_lock<std::mutex> lock(state.conn_mutex);
+        for (int fd : state.conn_fds) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        state.conn_cv.wait(lock, [&state] { return state.n_conn == 0; });
+    }
+    return 0;
+}
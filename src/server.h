@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+
+// Long-lived serving front-end: the model stays loaded and chat requests
+// arrive as HTTP on a Unix socket or a 127.0.0.1 TCP port (--serve ADDR).
+//
+//   POST /completion {"messages": [{"role": "user", "content": "..."}], "n_predict": 128}
+//   POST /completion {"prompt": "...", "seed": 42, "priority": "batch", "deadline_ms": 5000}
+//   POST /completion {"model": "NAME", "prompt": "..."}
+//   POST /completion {"prompt": "...", "lora": [{"id": 0, "scale": 0.5}]}
+//   POST /completion {"prompt": "...", "stop": ["\nUser:", "###"]}
+//   POST /completion {"prompt": "...", "choices": [" positive", " negative", " neutral"]}
+//   POST /completion?n_predict=128&model=NAME   (Content-Type: text/plain, the prompt as body)
+//   GET  /health
+//
+// Tokens are streamed back as server-sent events while they are sampled;
+// closing the connection cancels the request. Generation ends at the
+// first "stop" string, which is not sent; text that may be the start of
+// one is held back until it is ruled out (stop.h). Up to n_parallel (-np)
+// requests are decoded together, one KV sequence per slot. Slots keep
+// their KV cache after a request, so a follow-up turn of the same chat
+// only prefills the tokens that are new. With --kv-swap DIR the cache of
+// slots idle for --kv-swap-idle seconds, or evicted for room (least
+// recently used first, only as many as needed), is written to DIR and read
+// back when a request continues that session; beyond --kv-swap-max MiB the
+// oldest files are removed. Admission order and the share of
+// prompt prefill per decode step are decided by scheduler.h; /health
+// reports queue depth and wait times per priority class.
+//
+// --models NAME=PATH,... serves further models beside -m (named after its
+// file): each gets its own context and slots with the same -c/-np, the
+// weights are shared by names that point at the same file (models.h), and
+// all of them take requests from one queue, routed by "model".
+//
+// Adapters given with --lora/--lora-scaled are loaded once with -m; "lora"
+// sets their scales for one request (the others keep the command-line
+// scale). Slots with different adapter scales are decoded in separate
+// llama_decode calls with the adapters switched in between, and cached or
+// swapped KV is only reused by requests with the same scales.
+//
+// With "choices" the completion is the most likely of the given strings:
+// at every step only the next tokens of the choices still in play are
+// candidates, and EOS stands for ending with a choice that is complete
+// while longer ones go on. A single choice is returned without a decode.
+// With --choice-head 1 the logits come from the candidates' rows of the
+// output matrix instead of the full vocabulary projection (head.h). Such
+// slots are decoded in a batch of their own; the final event carries the
+// index of the chosen string as "choice".
+//
+// A text/plain body is the raw prompt, with the other fields in the query
+// string. The request takes a slot as soon as its header is in, and the
+// prompt is tokenized and prefilled while the body is still uploading
+// (prompt_stream.h), so a long document is mostly decoded by the time its
+// last byte arrives. Content-Length is required.
+
+int server_run(common_params & params, const options & opts, llama_model * model, llama_context * ctx);
@@ -0,0 +1,93 @@
+#include "snapshot.h"
+
+#include "log.h"
+
+snapshot_store::snapshot_store(llama_context * ctx, llama_seq_id seq, int32_t n_max) : ctx(ctx), seq(seq) {
+    for (int32_t i = n_max; i >= 1; i--) {
+        free_seqs.push_back(seq + i);
+    }
+}
+
+snapshot_store::~snapshot_store() {
+    clear();
+}
+
+void snapshot_store::drop(snapshot & s) {
+    llama_kv_cache_seq_rm(ctx, s.seq, -1, -1);
+    free_seqs.push_back(s.seq);
+    common_sampler_free(s.smpl);
+    s.smpl = nullptr;
+    s.seq  = -1;
+}
+
+void snapshot_store::save(const snapshot & s) {
+    if (free_seqs.empty()) {
+        if (snaps.empty()) {
+            return; // no spare sequences
+        }
+        drop(snaps.front());
+        snaps.erase(snaps.begin());
+    }
+    snapshot copy = s;
+    copy.seq  = free_seqs.back();
+    copy.smpl = common_sampler_clone(s.smpl);
+    free_seqs.pop_back();
+    llama_kv_cache_seq_rm(ctx, copy.seq, -1, -1);
+    llama_kv_cache_seq_cp(ctx, seq, copy.seq, 0, copy.n_past);
+    snaps.push_back(std::move(copy));
+}
+
+bool snapshot_store::restore(size_t i, snapshot & out) {
+    if (i >= snaps.size()) {
+        return false;
+    }
+    while (snaps.size() > i + 1) {
+        pop();
+    }
+    const snapshot & s = snaps[i];
+    llama_kv_cache_seq_rm(ctx, seq, -1, -1);
+    llama_kv_cache_seq_cp(ctx, s.seq, seq, -1, -1);
+    out      = s;
+    out.smpl = common_sampler_clone(s.smpl);
+    out.seq  = -1;
+    return true;
+}
+
+common_sampler * snapshot_store::reseed(const snapshot & s, const llama_model * model,
+        common_params_sampling sparams, uint32_t seed) const {
+    sparams.seed = seed;
+    common_sampler * smpl = common_sampler_init(model, sparams);
+    if (!smpl) {
+        return nullptr;
+    }
+    // replay what the snapshot's sampler saw to rebuild the penalty state
+    for (int32_t i = s.n_accepted; i < s.n_consumed; i++) {
+        common_sampler_accept(smpl, s.tokens[i], /* accept_grammar= */ false);
+    }
+    return smpl;
+}
+
+void snapshot_store::pop() {
+    if (!snaps.empty()) {
+        drop(snaps.back());
+        snaps.pop_back();
+    }
+}
+
+void snapshot_store::clear() {
+    if (!snaps.empty()) {
+        LOG_DBG("%s: dropping %zu snapshots\n", __func__, snaps.size());
+    }
+    while (!snaps.empty()) {
+        pop();
+    }
+}
+
+int32_t snapshot_store::find(bool reply, int32_t n) const {
+    for (int32_t i = (int32_t) snaps.size() - 1; i >= 0; i--) {
+        if (snaps[i].reply == reply && n-- == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
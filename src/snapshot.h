@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+#include "sampling.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// In-memory checkpoints of a generating sequence (--snapshots N).
+//
+// A snapshot pins the first n_past KV cells of a sequence under a spare
+// sequence id with llama_kv_cache_seq_cp(), which tags the cells with one
+// more id and copies no data, and keeps the token history and a clone of
+// the sampler (RNG and penalty state). Restoring retags the cells back, so
+// returning to an earlier turn or sampling an alternative continuation only
+// costs the tokens that follow the snapshot.
+//
+// Spare ids are seq + 1 .. seq + N, so the context needs n_seq_max > seq + N.
+// Snapshots hold on to their cells: the oldest one is dropped when all ids
+// are taken, and positions must not be shifted under them (context shift,
+// self-extend), so callers clear() the store before doing that.
+
+struct snapshot {
+    int32_t                  n_past = 0;   // cells [0, n_past) of the sequence
+    std::vector<llama_token> tokens;       // token history (input and generated)
+    std::vector<llama_token> pending;      // tokens to decode next, after n_past
+    int32_t                  n_consumed = 0; // tokens[0, n_consumed) were fed to the model
+    int32_t                  n_accepted = 0; // sampler saw tokens[n_accepted, n_consumed) since its last reset
+    int32_t                  n_remain   = 0; // generation budget
+    size_t                   n_msgs     = 0; // chat messages
+    bool                     reply      = false; // taken right before sampling a reply (else at a user turn)
+    common_sampler         * smpl       = nullptr; // owned by the store while saved
+
+    llama_seq_id             seq        = -1; // spare sequence holding the cells
+};
+
+struct snapshot_store {
+    snapshot_store(llama_context * ctx, llama_seq_id seq, int32_t n_max);
+    ~snapshot_store();
+
+    // checkpoints the first s.n_past cells of the sequence; the store takes a
+    // clone of s.smpl, the caller keeps its sampler
+    void save(const snapshot & s);
+
+    // rolls the sequence back to snapshot i (0 - oldest) and fills out with
+    // its state and a sampler clone owned by the caller; later snapshots are dropped
+    bool restore(size_t i, snapshot & out);
+
+    // a sampler with a new seed that saw the same tokens as s, so the
+    // continuation differs from the one the snapshot would replay
+    common_sampler * reseed(const snapshot & s, const llama_model * model, common_params_sampling sparams, uint32_t seed) const;
+
+    // drops the newest snapshot
+    void pop();
+    void clear();
+
+    size_t size() const { return snaps.size(); }
+    const snapshot & at(size_t i) const { return snaps[i]; }
+
+    // index of the n-th newest snapshot of the given kind (0 - newest), -1 if none
+    int32_t find(bool reply, int32_t n = 0) const;
+
+private:
+    void drop(snapshot & s);
+
+    llama_context * ctx;
+    llama_seq_id    seq;
+
+    std::vector<snapshot>     snaps;     // oldest first
+    std::vector<llama_seq_id> free_seqs; // spare ids not holding a snapshot
+};
@@ -0,0 +1,69 @@
+#include "stop.h"
+
+#include <deque>
+
+stop_matcher::stop_matcher(const std::vector<std::string> & strings, const std::vector<llama_token> & tokens) :
+        tokens(tokens.begin(), tokens.end()) {
+    std::array<int32_t, 256> none;
+    none.fill(-1);
+    next.push_back(none);
+
+    // trie of the stop strings
+    for (const std::string & s : strings) {
+        if (s.empty()) {
+            continue;
+        }
+        int32_t u = 0;
+        for (unsigned char c : s) {
+            if (next[u][c] < 0) {
+                next[u][c] = (int32_t) next.size();
+                next.push_back(none);
+                depth.push_back(depth[u] + 1);
+                out.push_back(-1);
+            }
+            u = next[u][c];
+        }
+        out[u] = depth[u];
+        n_strings++;
+    }
+
+    // failure links in breadth-first order, folded into the transitions
+    std::vector<int32_t> fail(next.size(), 0);
+    std::deque<int32_t>  queue;
+    for (int c = 0; c < 256; c++) {
+        if (next[0][c] < 0) {
+            next[0][c] = 0;
+        } else {
+            queue.push_back(next[0][c]);
+        }
+    }
+    while (!queue.empty()) {
+        const int32_t u = queue.front();
+        queue.pop_front();
+        if (out[u] < 0) {
+            out[u] = out[fail[u]];
+        }
+        for (int c = 0; c < 256; c++) {
+            const int32_t v = next[u][c];
+            if (v < 0) {
+                next[u][c] = next[fail[u]][c];
+            } else {
+                fail[v] = next[fail[u]][c];
+                queue.push_back(v);
+            }
+        }
+    }
+}
+
+size_t stop_matcher::feed(const std::string & text) {
+    if (n_strings == 0) {
+        return std::string::npos;
+    }
+    for (size_t i = 0; i < text.size(); i++) {
+        state = next[state][(unsigned char) text[i]];
+        if (out[state] >= 0) {
+            return i + 1;
+        }
+    }
+    return std::string::npos;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "llama.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Incremental stop-sequence matching (reverse prompts, "stop" of a request).
+//
+// The stop strings are compiled into an Aho-Corasick automaton with every
+// transition resolved, so the text is fed one token piece at a time and
+// each byte costs one table lookup, however many stop strings there are and
+// however far back a match started. n_partial() is how many bytes at the
+// end of the fed text could still grow into a stop string; a stream holds
+// those back until they either complete a match or are ruled out. Stop
+// tokens (reverse prompts that tokenize to a single token) are a hash set.
+
+struct stop_matcher {
+    stop_matcher() = default;
+    stop_matcher(const std::vector<std::string> & strings, const std::vector<llama_token> & tokens);
+
+    bool empty() const { return n_strings == 0 && tokens.empty(); }
+
+    // feeds text; the offset just past the first stop string that ends in it, npos if none
+    size_t feed(const std::string & text);
+
+    // a stop string ends at the last byte fed
+    bool at_match() const { return out[state] >= 0; }
+
+    // length of the stop string found by the last feed()/at_match()
+    size_t match_len() const { return out[state] >= 0 ? (size_t) out[state] : 0; }
+
+    // bytes at the end of the fed text that are the start of a stop string
+    size_t n_partial() const { return (size_t) depth[state]; }
+
+    bool is_stop_token(llama_token id) const { return tokens.count(id) > 0; }
+
+    void reset() { state = 0; }
+
+private:
+    std::vector<std::array<int32_t, 256>> next;  // transition per node and byte
+    std::vector<int32_t>                  depth = { 0 };
+    std::vector<int32_t>                  out   = { -1 }; // length of the longest stop string ending at the node, -1 - none
+
+    std::unordered_set<llama_token> tokens;
+
+    int32_t state     = 0;
+    size_t  n_strings = 0;
+};
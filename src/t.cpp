@@ -1,4 +1,6 @@
 #include "llama.h"
+#include "kv_pages.h"
+#include "kv_swap.h"
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
@@ -73,30 +75,6 @@ static std::string token_to_piece(const struct llama_context * ctx, llama_token
     return piece;
 }
 
-static std::string string_from(const struct llama_context * ctx, const std::vector<llama_token> & tokens) {
-    std::stringstream buf;
-    buf << "[ ";
-    bool first = true;
-    for (const auto & token : tokens) {
-        if (!first) {
-            buf << ", ";
-        } else {
-            first = false;
-        }
-        auto detokenized = token_to_piece(ctx, token);
-        detokenized.erase(
-            std::remove_if(
-                detokenized.begin(),
-                detokenized.end(),
-                [](const unsigned char c) { return !std::isprint(c); }),
-            detokenized.end());
-        buf << "'" << detokenized << "'"
-            << ":" << std::to_string(token);
-    }
-    buf << " ]";
-    return buf.str();
-}
-
 static std::string detokenize(llama_context * ctx, const std::vector<llama_token> & tokens, 
                               bool remove_special = false, bool unparse_special = true) {
     std::string text;
@@ -181,6 +159,7 @@ static bool inference() {
     uint32_t n_ctx = llama_n_ctx(ctx);
     printf("n_ctx: %d\n", n_ctx);
     int n_past = 0;
+    kv_pages pages(ctx);
     std::vector<llama_token> embd;
     if (!tokens.empty()) {
         // Use tokens from the prompt
@@ -191,8 +170,7 @@ static bool inference() {
     int n_remaining = n_predict;
     llama_token last = 0;
     while (n_remaining > 0) {
-        int n_ctx_used = llama_get_kv_cache_used_cells(ctx);
-        if (n_ctx_used + embd.size() > n_ctx) {
+        if (!pages.append(0, (int32_t)embd.size())) {
             fprintf(stderr, "context size exceeded\n");
             break;
         }
@@ -214,10 +192,51 @@ static bool inference() {
         n_remaining--;
     }
     printf("\n");
+    printf("%s\n", pages.print().c_str());
     printf("result: \"%s\"\n", detokenize(ctx, embd).c_str());
     return true;
 }
 
+static bool prefill(const std::vector<llama_token> & tokens) {
+    llama_kv_cache_clear(ctx);
+    std::vector<llama_token> t = tokens;
+    return llama_decode(ctx, llama_batch_get_one(t.data(), t.size())) == 0;
+}
+
+// an index from kv_swap::find() goes stale when a later swap_out() removes the oldest file
+// beyond --kv-swap-max; the server looks the session up again by path before swap_in()
+static bool kv_swap_cap() {
+    std::vector<llama_token> a, b, c;
+    for (llama_token i = 0; i < 16; i++) {
+        a.push_back(100 + i);
+        b.push_back(200 + i);
+        c.push_back(300 + i);
+    }
+    size_t n_entry = 0;
+    {
+        kv_swap probe(ctx, ".");
+        if (!prefill(a) || !probe.swap_out(0, a)) {
+            fprintf(stderr, "kv_swap_cap: swap out failed\n");
+            return false;
+        }
+        n_entry = probe.n_bytes();
+    }
+    // room for two sessions of 16 tokens, the third swap_out() removes the oldest
+    kv_swap swap(ctx, ".", 2 * n_entry + n_entry / 2);
+    bool ok = prefill(c) && swap.swap_out(0, c) && prefill(a) && swap.swap_out(0, a);
+    size_t n_prefix = 0;
+    const int32_t i = ok ? swap.find(a, n_prefix) : -1;
+    const std::string path = i >= 0 ? swap.at(i).path : "";
+    ok = ok && prefill(b) && swap.swap_out(0, b); // c goes, a moves from 1 to 0
+    llama_kv_cache_clear(ctx);
+    const int32_t j = swap.index_of(path);
+    std::vector<llama_token> restored;
+    ok = ok && i == 1 && j == 0 && swap.n_entries() == 2 && swap.swap_in(j, 0, restored) && restored == a;
+    printf("kv_swap_cap: found at %d, at %d after the eviction, %s\n", i, j, ok ? "restored" : "FAILED");
+    llama_kv_cache_clear(ctx);
+    return ok;
+}
+
 int main(int argc, char** argv) {
     assert(argc > 1);
     // only print errors
@@ -232,7 +251,8 @@ int main(int argc, char** argv) {
     printf("Model loaded and context created.\n");
     init();
     inference();
+    const bool ok = kv_swap_cap();
     deinit();
-    return 0;
+    return ok ? 0 : 1;
 }
 
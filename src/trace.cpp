@@ -0,0 +1,97 @@
+#include "trace.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+bool g_trace_enabled = false;
+
+struct trace_event {
+    const char * name;
+    int64_t      t_begin;
+    int64_t      t_end;
+    int32_t      arg;
+    uint32_t     tid;
+};
+
+static std::string              g_trace_path;
+static std::vector<trace_event> g_trace_ring;
+static std::atomic<uint64_t>    g_trace_head{0};
+static int64_t                  g_trace_layer_t0 = 0; // end of the previous layer in the running ubatch
+
+void trace_init(const std::string & path, int32_t capacity) {
+    g_trace_path = path;
+    g_trace_ring.assign(capacity > 0 ? capacity : 1, trace_event{});
+    g_trace_head = 0;
+    g_trace_enabled = true;
+}
+
+void trace_add(const char * name, int64_t t_begin, int64_t t_end, int32_t arg) {
+    static thread_local const uint32_t tid = (uint32_t) std::hash<std::thread::id>{}(std::this_thread::get_id()) % 100000;
+    const uint64_t i = g_trace_head++;
+    g_trace_ring[i % g_trace_ring.size()] = { name, t_begin, t_end, arg, tid };
+}
+
+void trace_decode_begin() {
+    if (g_trace_enabled) {
+        g_trace_layer_t0 = ggml_time_us();
+    }
+}
+
+bool trace_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    (void) user_data;
+    if (strcmp(t->name, "inp_embd") == 0) {
+        // first node of every ubatch: the scheduler asks about it right before computing it, so
+        // layer 0 starts here rather than at the previous ubatch's output head and input upload
+        if (ask && g_trace_enabled) {
+            g_trace_layer_t0 = ggml_time_us();
+        }
+        return false;
+    }
+    if (strncmp(t->name, "l_out-", 6) != 0) {
+        return false;
+    }
+    if (ask) {
+        return g_trace_enabled;
+    }
+    const int64_t t_now = ggml_time_us();
+    trace_add("layer", g_trace_layer_t0, t_now, atoi(t->name + 6));
+    g_trace_layer_t0 = t_now;
+    return true;
+}
+
+bool trace_write() {
+    if (!g_trace_enabled) {
+        return true;
+    }
+    FILE * f = fopen(g_trace_path.c_str(), "w");
+    if (!f) {
+        LOG_ERR("%s: failed to open '%s'\n", __func__, g_trace_path.c_str());
+        return false;
+    }
+    const uint64_t head  = g_trace_head;
+    const uint64_t n     = std::min<uint64_t>(head, g_trace_ring.size());
+    const uint64_t first = head - n;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (uint64_t i = first; i < head; i++) {
+        const trace_event & e = g_trace_ring[i % g_trace_ring.size()];
+        fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lld,\"dur\":%lld",
+                i == first ? "" : ",\n", e.name, e.tid, (long long) e.t_begin, (long long) (e.t_end - e.t_begin));
+        if (e.arg >= 0) {
+            fprintf(f, ",\"args\":{\"n\":%d}", e.arg);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    LOG_INF("%s: wrote %llu trace events to '%s'%s\n", __func__, (unsigned long long) n, g_trace_path.c_str(),
+            head > n ? " (ring buffer wrapped, oldest events dropped)" : "");
+    return true;
+}
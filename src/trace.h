@@ -0,0 +1,52 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdint>
+#include <string>
+
+// Opt-in per-token latency tracing (--trace FILE).
+//
+// Phases are recorded into a fixed-size ring buffer and written as Chrome
+// trace JSON (chrome://tracing, ui.perfetto.dev) by trace_write(). While
+// tracing is off every TRACE_SCOPE costs one well-predicted branch on
+// g_trace_enabled, so the instrumentation stays in release builds.
+//
+// Per-layer graph compute is observed through the ggml scheduler eval
+// callback on the "l_out-<il>" tensors; installing it splits the graph at
+// layer boundaries, which is why it is only installed while tracing. Each
+// ubatch restarts the layer clock at its "inp_embd" node, so a layer span
+// never includes the output head or the input setup between ubatches.
+
+extern bool g_trace_enabled;
+
+void trace_init(const std::string & path, int32_t capacity);
+void trace_add(const char * name, int64_t t_begin, int64_t t_end, int32_t arg = -1);
+bool trace_write();
+
+// eval callback for common_params::cb_eval; call trace_decode_begin() right before llama_decode()
+// for graphs that have no "inp_embd" node
+bool trace_eval_callback(struct ggml_tensor * t, bool ask, void * user_data);
+void trace_decode_begin();
+
+struct trace_scope {
+    const char * name;
+    int32_t      arg;
+    int64_t      t_begin;
+
+    trace_scope(const char * name, int32_t arg = -1) : name(name), arg(arg), t_begin(0) {
+        if (g_trace_enabled) {
+            t_begin = ggml_time_us();
+        }
+    }
+
+    ~trace_scope() {
+        if (g_trace_enabled) {
+            trace_add(name, t_begin, ggml_time_us(), arg);
+        }
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...)    trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)